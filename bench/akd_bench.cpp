@@ -0,0 +1,252 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "cmake.h"
+#include "keyboardsymbols.h"
+#include "layout.h"
+#include "shortcut.h"
+#include "windowtable.h"
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <system_error>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <X11/XKBlib.h>
+#include <X11/keysym.h>
+
+using Clock = std::chrono::steady_clock;
+
+extern char **environ;
+
+struct Result {
+    std::string name;
+    std::vector<double> samples; // Microseconds per operation, sorted
+};
+
+[[nodiscard]] static double percentile(const std::vector<double> &samples, double fraction)
+{
+    return samples[static_cast<size_t>(fraction * static_cast<double>(samples.size() - 1))];
+}
+
+// Runs the function the specified number of times, each call performs the specified number of operations
+static void measure(std::vector<Result> &results, std::string name, size_t iterations, const std::function<void(size_t)> &function, size_t operations = 1)
+{
+    Result &result = results.emplace_back(Result{std::move(name), {}});
+    result.samples.reserve(iterations);
+    for (size_t i = 0; i < iterations; ++i) {
+        const Clock::time_point start = Clock::now();
+        function(i);
+        const std::chrono::duration<double, std::micro> elapsed = Clock::now() - start;
+        result.samples.push_back(elapsed.count() / static_cast<double>(operations));
+    }
+    std::sort(result.samples.begin(), result.samples.end());
+}
+
+static void printText(const std::vector<Result> &results)
+{
+    for (const Result &result : results)
+        std::cout << boost::format("%-24s median %10.3f us  p99 %10.3f us  min %10.3f us\n") % result.name % percentile(result.samples, 0.5) % percentile(result.samples, 0.99) % result.samples.front();
+}
+
+// Names contain only safe characters, so they don't need escaping
+static void printJson(const std::vector<Result> &results, size_t iterations)
+{
+    std::cout << boost::format("{\"version\":\"%d.%d.%d\",\"iterations\":%d,\"results\":[") % PROJECT_VERSION_MAJOR % PROJECT_VERSION_MINOR % PROJECT_VERSION_PATCH % iterations;
+    for (auto it = results.cbegin(); it != results.cend(); ++it) {
+        if (it != results.cbegin())
+            std::cout << ',';
+        double sum = 0;
+        for (double sample : it->samples)
+            sum += sample;
+        std::cout << boost::format("{\"name\":\"%s\",\"mean_us\":%.3f,\"median_us\":%.3f,\"p99_us\":%.3f,\"min_us\":%.3f,\"max_us\":%.3f}")
+                % it->name % (sum / static_cast<double>(it->samples.size())) % percentile(it->samples, 0.5) % percentile(it->samples, 0.99) % it->samples.front() % it->samples.back();
+    }
+    std::cout << "]}\n";
+}
+
+// Resource IDs of different X clients differ in high bits, each client allocates them sequentially
+static Window sessionWindow(size_t index, size_t clients)
+{
+    constexpr size_t firstClient = 0xe;
+    return static_cast<Window>((firstClient + index % clients) << 21 | index / clients);
+}
+
+// Simulates a long session: windows are created, focused several times and destroyed
+template<typename Create, typename Focus, typename Destroy>
+static void windowsSession(size_t windowsCount, size_t clients, Create create, Focus focus, Destroy destroy)
+{
+    constexpr size_t aliveWindows = 64;
+    for (size_t i = 0; i < windowsCount; ++i) {
+        create(sessionWindow(i, clients));
+        for (size_t back = 0; back < aliveWindows && back < i; back += 8)
+            focus(sessionWindow(i - back, clients));
+        if (i >= aliveWindows)
+            destroy(sessionWindow(i - aliveWindows, clients));
+    }
+}
+
+// Starts the command with output discarded and waits for it
+static void runCommand(const std::filesystem::path &program, const char *argument)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    pid_t pid;
+    const std::string programString = program.string();
+    char *arguments[] = {const_cast<char *>(programString.c_str()), const_cast<char *>(argument), nullptr};
+    const int error = posix_spawn(&pid, programString.c_str(), &actions, nullptr, arguments, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (error != 0)
+        throw std::system_error(error, std::generic_category(), "Unable to start " + programString);
+
+    int status;
+    waitpid(pid, &status, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t iterations = 100;
+    bool json = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string_view(argv[i]) == "--json")
+            json = true;
+        else
+            iterations = std::stoul(argv[i]);
+    }
+
+    std::vector<Result> results;
+
+    constexpr size_t sessionWindows = 100000;
+    measure(results, "window-table-session", iterations, [](size_t) {
+        WindowTable windows;
+        windowsSession(
+            sessionWindows, 1, [&windows](Window window) { windows[windows.tryEmplace(window).first].group = 1; },
+            [&windows](Window window) { windows[windows.tryEmplace(window).first].layoutIndex = 1; },
+            [&windows](Window window) { windows.erase(window); });
+    });
+    // Windows of many clients with the same resource offsets
+    constexpr size_t sessionClients = 32;
+    measure(results, "window-table-clients-session", iterations, [](size_t) {
+        WindowTable windows;
+        windowsSession(
+            sessionWindows, sessionClients, [&windows](Window window) { windows[windows.tryEmplace(window).first].group = 1; },
+            [&windows](Window window) { windows[windows.tryEmplace(window).first].layoutIndex = 1; },
+            [&windows](Window window) { windows.erase(window); });
+    });
+    measure(results, "unordered-map-session", iterations, [](size_t) {
+        std::unordered_map<Window, Keyboard> windows;
+        windowsSession(
+            sessionWindows, 1, [&windows](Window window) { windows.try_emplace(window).first->second.group = 1; },
+            [&windows](Window window) { windows.try_emplace(window).first->second.layoutIndex = 1; },
+            [&windows](Window window) { windows.erase(window); });
+    });
+
+    const std::unique_ptr<Display, DisplayDeleter> display(XkbOpenDisplay(nullptr, nullptr, nullptr, nullptr, nullptr, nullptr));
+    if (!display) {
+        std::cerr << "Unable to connect to X server, run the benchmark under Xvfb\n";
+        return 1;
+    }
+
+    KeyboardSymbols symbols;
+    measure(results, "current-symbols", iterations, [&display, &symbols](size_t) {
+        symbols = KeyboardSymbols::currentSymbols(*display);
+    });
+
+    measure(results, "layout-apply-cold", iterations, [&display, &symbols](size_t i) {
+        Layout layout(*display, i % 2 ? "us,ru" : "us,de", symbols.options);
+        layout.apply();
+        XSync(display.get(), false);
+    });
+
+    std::vector<Layout> layouts;
+    layouts.emplace_back(*display, "us,ru", symbols.options);
+    layouts.emplace_back(*display, "us,de", symbols.options);
+    for (Layout &layout : layouts)
+        layout.apply();
+    measure(results, "layout-apply-cached", iterations, [&display, &layouts](size_t i) {
+        layouts[i % 2].apply();
+        XSync(display.get(), false);
+    });
+
+    // Focus change between windows with different layouts and groups, like the daemon commits it
+    WindowTable windows;
+    constexpr Window firstWindow = 0x1c00000;
+    windows[windows.tryEmplace(firstWindow).first] = {1, 0};
+    windows[windows.tryEmplace(firstWindow + 1).first] = {0, 1};
+    measure(results, "focus-transition", iterations, [&display, &layouts, &windows](size_t i) {
+        const Keyboard keyboard = windows[windows.tryEmplace(firstWindow + i % 2).first];
+        layouts[keyboard.layoutIndex].apply();
+        XkbLockGroup(display.get(), XkbUseCoreKbd, keyboard.group);
+        XSync(display.get(), false);
+    });
+
+    ShortcutTable shortcuts;
+    shortcuts.add("Ctrl+Alt+F", {ShortcutTable::Action::NextLayout});
+    shortcuts.add("Ctrl+Alt+B", {ShortcutTable::Action::PreviousLayout});
+    shortcuts.add("Ctrl+Alt+L", {ShortcutTable::Action::LastLayout});
+    for (unsigned index = 0; index < 4; ++index)
+        shortcuts.addIndexed(std::to_string(index) + " Meta+F" + std::to_string(index + 1), ShortcutTable::Action::SetGroup, XkbNumKbdGroups);
+    shortcuts.computeKeycodes(layouts.front(), 0);
+    if (!shortcuts.grab(*display, DefaultRootWindow(display.get()), 0).empty()) {
+        std::cerr << "Shortcuts are already grabbed by another application\n";
+        return 1;
+    }
+
+    // Half of events hit a shortcut
+    XKeyEvent event{};
+    event.type = KeyPress;
+    event.state = ControlMask | Mod1Mask | Mod2Mask;
+    const KeyCode hitKeycode = layouts.front().keycode(XK_F);
+    const KeyCode missKeycode = layouts.front().keycode(XK_G);
+    constexpr size_t dispatchOperations = 1000;
+    size_t dispatched = 0;
+    measure(
+        results, "shortcut-dispatch", iterations, [&](size_t) {
+            for (size_t i = 0; i < dispatchOperations; ++i) {
+                event.keycode = i % 2 ? hitKeycode : missKeycode;
+                if (shortcuts.find(event))
+                    ++dispatched;
+            }
+        },
+        dispatchOperations);
+    if (dispatched == 0)
+        std::cerr << "Shortcut dispatch didn't find any shortcut\n";
+
+    // One-shot command path, including process startup and X connection
+    if (const std::filesystem::path akd = std::filesystem::path(argv[0]).parent_path() / "akd"; std::filesystem::exists(akd))
+        measure(results, "command-startup", iterations, [&akd](size_t) { runCommand(akd, "-d"); });
+    else
+        std::cerr << akd << " is not found, skipping command startup\n";
+
+    if (json)
+        printJson(results, iterations);
+    else
+        printText(results);
+}
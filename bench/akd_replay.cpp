@@ -0,0 +1,206 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "cmake.h"
+#include "eventrecorder.h"
+#include "keyboardcore.h"
+
+#include <boost/format.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+using Clock = std::chrono::steady_clock;
+
+static size_t allocationsCount = 0;
+
+void *operator new(size_t size)
+{
+    ++allocationsCount;
+    if (void *pointer = std::malloc(size == 0 ? 1 : size))
+        return pointer;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+    std::free(pointer);
+}
+
+// Answers new windows with recorded states and hashes all calls, so runs of different builds can be compared
+class ReplayBackend : public KeyboardCore::Backend
+{
+public:
+    explicit ReplayBackend(const std::vector<EventRecorder::Recording::Event> &events)
+        : m_events(events)
+    {
+    }
+
+    void windowCreated(Window window, Keyboard &keyboard) override
+    {
+        hash(1, window);
+        if (m_position < m_events.size() && m_events[m_position].type == EventRecorder::Type::WindowState && m_events[m_position].window == window) {
+            keyboard.group = m_events[m_position].value;
+            keyboard.layoutIndex = m_events[m_position].index;
+            ++m_position;
+        }
+    }
+
+    void windowChanged(Window window, Keyboard keyboard) override
+    {
+        hash(2, window, keyboard.group, keyboard.layoutIndex);
+    }
+
+    void windowDestroyed(Window window) override
+    {
+        hash(3, window);
+    }
+
+    void groupChanged(size_t layoutIndex, unsigned char group) override
+    {
+        hash(4, None, group, layoutIndex);
+    }
+
+    void applyLayout(size_t layoutIndex) override
+    {
+        hash(5, None, 0, layoutIndex);
+    }
+
+    void lockGroup(unsigned char group) override
+    {
+        hash(6, None, group);
+    }
+
+    [[nodiscard]] const EventRecorder::Recording::Event *next()
+    {
+        // States of new windows are consumed by windowCreated
+        while (m_position < m_events.size() && m_events[m_position].type == EventRecorder::Type::WindowState)
+            ++m_position;
+        return m_position < m_events.size() ? &m_events[m_position++] : nullptr;
+    }
+
+    [[nodiscard]] uint64_t digest() const
+    {
+        return m_digest;
+    }
+
+private:
+    // FNV-1a
+    void hash(uint8_t call, Window window, unsigned char group = 0, size_t layoutIndex = 0)
+    {
+        for (const uint64_t value : {uint64_t{call}, uint64_t{window}, uint64_t{group}, uint64_t{layoutIndex}}) {
+            m_digest ^= value;
+            m_digest *= 0x100000001b3;
+        }
+    }
+
+    const std::vector<EventRecorder::Recording::Event> &m_events;
+    size_t m_position = 0;
+    uint64_t m_digest = 0xcbf29ce484222325;
+};
+
+static void replay(const EventRecorder::Recording &recording, ReplayBackend &backend)
+{
+    KeyboardCore core(backend);
+    while (const EventRecorder::Recording::Event *event = backend.next()) {
+        switch (event->type) {
+        case EventRecorder::Type::Settings:
+            core.configure(recording.settings[event->index]);
+            break;
+        case EventRecorder::Type::Layouts:
+            core.setLayouts(recording.layouts[event->index].groupsCounts, recording.layouts[event->index].newIndices);
+            break;
+        case EventRecorder::Type::Initialize:
+            core.initialize(event->window, event->value);
+            break;
+        case EventRecorder::Type::Focus:
+            core.activateWindow(event->window);
+            break;
+        case EventRecorder::Type::Destroy:
+            core.destroyWindow(event->window);
+            break;
+        case EventRecorder::Type::Action:
+            core.processAction({static_cast<ShortcutTable::Action>(event->value), event->index});
+            break;
+        case EventRecorder::Type::Group:
+            core.saveGroup(event->value);
+            break;
+        case EventRecorder::Type::Commit:
+            core.commit();
+            break;
+        case EventRecorder::Type::WindowState:
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = nullptr;
+    size_t repeat = 10;
+    bool json = false;
+    for (int i = 1; i < argc; ++i) {
+        if (std::string_view(argv[i]) == "--json")
+            json = true;
+        else if (!path)
+            path = argv[i];
+        else
+            repeat = std::stoul(argv[i]);
+    }
+    if (!path || repeat == 0) {
+        std::cerr << "Usage: " << argv[0] << " <recording> [repeat] [--json]\n";
+        return EXIT_FAILURE;
+    }
+
+    const EventRecorder::Recording recording = EventRecorder::read(path);
+
+    // Every run starts from scratch and should produce the same calls
+    uint64_t digest = 0;
+    size_t allocations = 0;
+    const Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < repeat; ++i) {
+        ReplayBackend backend(recording.events);
+        const size_t allocationsBefore = allocationsCount;
+        replay(recording, backend);
+        allocations += allocationsCount - allocationsBefore;
+        if (i != 0 && backend.digest() != digest) {
+            std::cerr << "Replay is not deterministic\n";
+            return EXIT_FAILURE;
+        }
+        digest = backend.digest();
+    }
+    const std::chrono::duration<double> elapsed = Clock::now() - start;
+
+    const double events = static_cast<double>(recording.events.size() * repeat);
+    const double eventsPerSecond = events / elapsed.count();
+    const double allocationsPerEvent = static_cast<double>(allocations) / events;
+    if (json) {
+        std::cout << boost::format("{\"version\":\"%d.%d.%d\",\"events\":%d,\"repeat\":%d,\"events_per_second\":%.0f,\"allocations_per_event\":%.3f,\"digest\":\"%016x\"}\n")
+                % PROJECT_VERSION_MAJOR % PROJECT_VERSION_MINOR % PROJECT_VERSION_PATCH % recording.events.size() % repeat % eventsPerSecond % allocationsPerEvent % digest;
+    } else {
+        std::cout << boost::format("%d events x %d: %.0f events/s, %.3f allocations per event, digest %016x\n") % recording.events.size() % repeat % eventsPerSecond % allocationsPerEvent % digest;
+    }
+}
@@ -0,0 +1,139 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "daemonclient.h"
+
+#include "server.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Stopped or stuck daemon shouldn't block the command, it's performed through X server instead
+static constexpr timeval replyTimeout{0, 300'000};
+
+// Parses arguments manually, Boost.Program_options is too slow for this path
+static std::optional<std::string> parseCommand(int argc, char *argv[])
+{
+    if (argc == 2) {
+        const std::string_view argument = argv[1];
+        if (argument == "-c" || argument == "--print-current-group")
+            return "get-group";
+        if (argument == "-d" || argument == "--print-current-group-index")
+            return "get-group-index";
+        if (argument == "-x" || argument == "--next-group")
+            return "next-group";
+        if (argument == "--stats")
+            return "stats";
+
+        constexpr std::array<std::string_view, 2> setGroupPrefixes = {"--set-group=", "-i"};
+        for (const std::string_view prefix : setGroupPrefixes) {
+            if (argument.size() > prefix.size() && argument.substr(0, prefix.size()) == prefix)
+                return "set-group " + std::string(argument.substr(prefix.size()));
+        }
+    } else if (argc == 3) {
+        const std::string_view argument = argv[1];
+        if (argument == "-i" || argument == "--set-group")
+            return "set-group " + std::string(argv[2]);
+    }
+
+    return std::nullopt;
+}
+
+std::optional<int> runDaemonCommand(int argc, char *argv[])
+{
+    std::optional<std::string> command = parseCommand(argc, argv);
+    if (!command)
+        return std::nullopt;
+
+    const std::filesystem::path socketPath = Server::defaultPath();
+    const std::string &path = socketPath.native();
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        return std::nullopt;
+    std::copy(path.cbegin(), path.cend(), address.sun_path);
+
+    // Fall back to X server if the daemon is not running
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return std::nullopt;
+    // Timeouts also limit connecting when the daemon doesn't accept clients
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &replyTimeout, sizeof(replyTimeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &replyTimeout, sizeof(replyTimeout));
+
+    // Socket in a directory of another user could belong to a fake daemon
+    if (!Server::hasPrivateDirectory(socketPath) || connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == -1) {
+        close(fd);
+        // Only the daemon has statistics
+        if (*command == "stats") {
+            std::cerr << "Unable to connect to the daemon socket " << path << '\n';
+            return 1;
+        }
+        return std::nullopt;
+    }
+
+    // Single line reply is expected
+    command->push_back('\n');
+    std::string reply;
+    bool sent = send(fd, command->data(), command->size(), MSG_NOSIGNAL) == static_cast<ssize_t>(command->size());
+    bool timedOut = !sent && (errno == EAGAIN || errno == EWOULDBLOCK);
+    while (sent && reply.find('\n') == std::string::npos) {
+        std::array<char, 256> buffer;
+        const ssize_t size = recv(fd, buffer.data(), buffer.size(), 0);
+        if (size == -1 && errno == EINTR)
+            continue;
+        timedOut = size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        if (size <= 0)
+            break;
+        reply.append(buffer.data(), static_cast<size_t>(size));
+    }
+    close(fd);
+
+    if (timedOut) {
+        if (*command == "stats") {
+            std::cerr << "The daemon doesn't respond on " << path << '\n';
+            return 1;
+        }
+        return std::nullopt;
+    }
+
+    const size_t replyEnd = reply.find('\n');
+    if (!sent || replyEnd == std::string::npos) {
+        std::cerr << "Unable to get reply from the daemon\n";
+        return 1;
+    }
+    reply.resize(replyEnd);
+
+    if (reply.rfind("error: ", 0) == 0) {
+        std::cerr << reply.substr(std::strlen("error: ")) << '\n';
+        return 1;
+    }
+    if (reply != "ok")
+        std::cout << reply << '\n';
+    return 0;
+}
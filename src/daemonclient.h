@@ -0,0 +1,29 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DAEMONCLIENT_H
+#define DAEMONCLIENT_H
+
+#include <optional>
+
+// Executes one-shot commands through the daemon socket without connecting to X server.
+// Returns exit code or nothing if arguments are not a one-shot command or the daemon is not running.
+[[nodiscard]] std::optional<int> runDaemonCommand(int argc, char *argv[]);
+
+#endif // DAEMONCLIENT_H
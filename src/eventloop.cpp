@@ -0,0 +1,163 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "eventloop.h"
+
+#include <array>
+#include <limits>
+#include <system_error>
+
+#include <csignal>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+// Internal descriptors use ids that can't be passed to add()
+static constexpr uint32_t signalId = std::numeric_limits<uint32_t>::max();
+static constexpr uint32_t timerId = signalId - 1;
+
+EventLoop::EventLoop()
+    : m_epoll(epoll_create1(EPOLL_CLOEXEC))
+{
+    if (m_epoll == -1)
+        throw std::system_error(errno, std::system_category(), "Unable to create event loop");
+
+    // Termination and user signals are received through descriptor to handle them in the loop
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    if (sigprocmask(SIG_BLOCK, &signals, nullptr) == -1) {
+        close(m_epoll);
+        throw std::system_error(errno, std::system_category(), "Unable to block signals");
+    }
+
+    m_signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_signalFd == -1 || m_timerFd == -1 || !add(m_signalFd, EPOLLIN, signalId) || !add(m_timerFd, EPOLLIN, timerId)) {
+        const int error = errno;
+        if (m_signalFd != -1)
+            close(m_signalFd);
+        if (m_timerFd != -1)
+            close(m_timerFd);
+        close(m_epoll);
+        throw std::system_error(error, std::system_category(), "Unable to create event loop");
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    close(m_timerFd);
+    close(m_signalFd);
+    close(m_epoll);
+}
+
+bool EventLoop::add(int fd, uint32_t events, uint32_t id)
+{
+    epoll_event event{};
+    event.events = events;
+    event.data.u32 = id;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) == -1) {
+        if (errno == EPERM)
+            return false;
+        throw std::system_error(errno, std::system_category(), "Unable to watch descriptor");
+    }
+    return true;
+}
+
+void EventLoop::remove(int fd)
+{
+    // Descriptors that weren't added are ignored, so it's safe to call from destructors
+    epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void EventLoop::setDeadline(std::optional<std::chrono::steady_clock::time_point> deadline)
+{
+    if (deadline == m_deadline)
+        return;
+
+    // Zero value disarms the timer, steady clock is monotonic clock on Linux
+    itimerspec timer{};
+    if (deadline) {
+        const auto sinceEpoch = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline->time_since_epoch());
+        timer.it_value.tv_sec = static_cast<time_t>(sinceEpoch.count() / 1'000'000'000);
+        timer.it_value.tv_nsec = static_cast<long>(sinceEpoch.count() % 1'000'000'000);
+        if (timer.it_value.tv_sec == 0 && timer.it_value.tv_nsec == 0)
+            timer.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &timer, nullptr) == -1)
+        throw std::system_error(errno, std::system_category(), "Unable to set timer");
+    m_deadline = deadline;
+}
+
+const std::vector<uint32_t> &EventLoop::wait()
+{
+    m_readyIds.clear();
+
+    std::array<epoll_event, 8> events;
+    int eventsCount;
+    do {
+        eventsCount = epoll_wait(m_epoll, events.data(), events.size(), -1);
+    } while (eventsCount == -1 && errno == EINTR);
+    if (eventsCount == -1)
+        throw std::system_error(errno, std::system_category(), "Unable to wait for events");
+
+    for (int i = 0; i < eventsCount; ++i) {
+        switch (const uint32_t id = events[i].data.u32; id) {
+        case signalId: {
+            signalfd_siginfo signal;
+            while (read(m_signalFd, &signal, sizeof(signal)) == sizeof(signal)) {
+                if (signal.ssi_signo == SIGUSR1 || signal.ssi_signo == SIGUSR2)
+                    m_userSignals |= 1U << signal.ssi_signo;
+                else
+                    m_terminated = true;
+            }
+            break;
+        }
+        case timerId: {
+            // Reset readiness, the deadline is checked by the caller
+            uint64_t expirations;
+            [[maybe_unused]] const ssize_t size = read(m_timerFd, &expirations, sizeof(expirations));
+            m_deadline.reset();
+            break;
+        }
+        default:
+            m_readyIds.push_back(id);
+        }
+    }
+
+    return m_readyIds;
+}
+
+bool EventLoop::isTerminated() const
+{
+    return m_terminated;
+}
+
+bool EventLoop::takeUserSignal(int signal)
+{
+    const uint32_t mask = 1U << signal;
+    const bool received = m_userSignals & mask;
+    m_userSignals &= ~mask;
+    return received;
+}
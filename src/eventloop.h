@@ -0,0 +1,61 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Waits for descriptors, a single deadline timer and termination signals in one epoll instance.
+// The loop sleeps until something happens, so there are no wakeups while idle.
+class EventLoop
+{
+public:
+    EventLoop();
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+    ~EventLoop();
+
+    // Ready descriptor will be reported by the specified id, returns false if the descriptor can't be polled (e.g. regular file)
+    bool add(int fd, uint32_t events, uint32_t id);
+    // Stops watching the descriptor before it's closed, e.g. after its X connection was lost
+    void remove(int fd);
+    // Rearms the timer only if the deadline was changed, std::nullopt disarms it
+    void setDeadline(std::optional<std::chrono::steady_clock::time_point> deadline);
+
+    // Returns ids of ready descriptors, deadline and signals are handled internally
+    [[nodiscard]] const std::vector<uint32_t> &wait();
+    [[nodiscard]] bool isTerminated() const;
+    // Returns true once after SIGUSR1 or SIGUSR2 was received
+    [[nodiscard]] bool takeUserSignal(int signal);
+
+private:
+    std::vector<uint32_t> m_readyIds;
+    std::optional<std::chrono::steady_clock::time_point> m_deadline;
+    int m_epoll;
+    int m_signalFd;
+    int m_timerFd;
+    bool m_terminated = false;
+    uint32_t m_userSignals = 0; // Bit for each received signal number
+};
+
+#endif // EVENTLOOP_H
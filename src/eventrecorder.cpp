@@ -0,0 +1,265 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "eventrecorder.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static constexpr std::string_view magic = "AKDR";
+static constexpr uint8_t formatVersion = 1;
+static constexpr size_t bufferSize = 64 * 1024;
+
+enum SettingsFlags : uint8_t {
+    DifferentGroups = 1 << 0,
+    DifferentLayouts = 1 << 1,
+    HasDefaultGroup = 1 << 2,
+};
+
+// Reads values in the native byte order, recordings are not meant to be moved between architectures
+class RecordingReader
+{
+public:
+    explicit RecordingReader(std::string data)
+        : m_data(std::move(data))
+    {
+    }
+
+    template<typename T>
+    [[nodiscard]] T get()
+    {
+        if (m_data.size() - m_position < sizeof(T))
+            throw std::logic_error("Recording is truncated");
+
+        T value;
+        std::memcpy(&value, m_data.data() + m_position, sizeof(T));
+        m_position += sizeof(T);
+        return value;
+    }
+
+    [[nodiscard]] bool atEnd() const
+    {
+        return m_position == m_data.size();
+    }
+
+private:
+    std::string m_data;
+    size_t m_position = 0;
+};
+
+EventRecorder::EventRecorder(const std::filesystem::path &path)
+    : m_fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600))
+{
+    if (m_fd == -1)
+        throw std::system_error(errno, std::system_category(), "Unable to open recording " + path.string());
+
+    m_buffer.reserve(bufferSize);
+    m_buffer.insert(m_buffer.end(), magic.cbegin(), magic.cend());
+    put(formatVersion);
+}
+
+EventRecorder::~EventRecorder()
+{
+    try {
+        flush();
+    } catch (const std::system_error &) {
+        // Destructor can't report the error, the recording is just incomplete
+    }
+    close(m_fd);
+}
+
+void EventRecorder::recordSettings(const KeyboardCore::Settings &settings)
+{
+    uint8_t flags = 0;
+    if (settings.useDifferentGroups)
+        flags |= DifferentGroups;
+    if (settings.useDifferentLayouts)
+        flags |= DifferentLayouts;
+    if (settings.defaultGroup)
+        flags |= HasDefaultGroup;
+
+    put(Type::Settings);
+    put(flags);
+    put(settings.defaultGroup.value_or(0));
+    put(static_cast<uint32_t>(settings.commitDelay.count()));
+    put(static_cast<uint32_t>(settings.maxWindows));
+}
+
+void EventRecorder::recordLayouts(const std::vector<unsigned char> &groupsCounts, const std::vector<uint16_t> &newIndices)
+{
+    put(Type::Layouts);
+    put(static_cast<uint16_t>(groupsCounts.size()));
+    for (const unsigned char groupsCount : groupsCounts)
+        put(groupsCount);
+    put(static_cast<uint16_t>(newIndices.size()));
+    for (const uint16_t newIndex : newIndices)
+        put(newIndex);
+}
+
+void EventRecorder::recordInitialize(Window window, unsigned char group)
+{
+    put(Type::Initialize);
+    put(static_cast<uint32_t>(window));
+    put(group);
+}
+
+void EventRecorder::recordFocus(Window window)
+{
+    put(Type::Focus);
+    put(static_cast<uint32_t>(window));
+}
+
+void EventRecorder::recordDestroy(Window window)
+{
+    put(Type::Destroy);
+    put(static_cast<uint32_t>(window));
+}
+
+void EventRecorder::recordAction(ShortcutTable::Binding binding)
+{
+    put(Type::Action);
+    put(binding.action);
+    put(binding.index);
+}
+
+void EventRecorder::recordGroup(unsigned char group)
+{
+    put(Type::Group);
+    put(group);
+}
+
+void EventRecorder::recordCommit()
+{
+    put(Type::Commit);
+}
+
+void EventRecorder::recordWindowState(Window window, Keyboard keyboard)
+{
+    put(Type::WindowState);
+    put(static_cast<uint32_t>(window));
+    put(keyboard.group);
+    put(keyboard.layoutIndex);
+}
+
+EventRecorder::Recording EventRecorder::read(const std::filesystem::path &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::system_error(errno, std::system_category(), "Unable to open recording " + path.string());
+
+    RecordingReader reader({std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()});
+    for (const char character : magic) {
+        if (reader.get<char>() != character)
+            throw std::logic_error(path.string() + " is not a recording");
+    }
+    if (reader.get<uint8_t>() != formatVersion)
+        throw std::logic_error("Unsupported recording version in " + path.string());
+
+    Recording recording;
+    while (!reader.atEnd()) {
+        Recording::Event &event = recording.events.emplace_back();
+        event.type = reader.get<Type>();
+        switch (event.type) {
+        case Type::Settings: {
+            KeyboardCore::Settings &settings = recording.settings.emplace_back();
+            const auto flags = reader.get<uint8_t>();
+            const auto defaultGroup = reader.get<unsigned char>();
+            settings.useDifferentGroups = flags & DifferentGroups;
+            settings.useDifferentLayouts = flags & DifferentLayouts;
+            if (flags & HasDefaultGroup)
+                settings.defaultGroup = defaultGroup;
+            settings.commitDelay = std::chrono::milliseconds(reader.get<uint32_t>());
+            settings.maxWindows = reader.get<uint32_t>();
+            event.index = static_cast<uint16_t>(recording.settings.size() - 1);
+            break;
+        }
+        case Type::Layouts: {
+            Recording::Layouts &layouts = recording.layouts.emplace_back();
+            layouts.groupsCounts.resize(reader.get<uint16_t>());
+            for (unsigned char &groupsCount : layouts.groupsCounts)
+                groupsCount = reader.get<unsigned char>();
+            layouts.newIndices.resize(reader.get<uint16_t>());
+            for (uint16_t &newIndex : layouts.newIndices)
+                newIndex = reader.get<uint16_t>();
+            event.index = static_cast<uint16_t>(recording.layouts.size() - 1);
+            break;
+        }
+        case Type::Initialize:
+            event.window = reader.get<uint32_t>();
+            event.value = reader.get<uint8_t>();
+            break;
+        case Type::Focus:
+        case Type::Destroy:
+            event.window = reader.get<uint32_t>();
+            break;
+        case Type::Action:
+            event.value = reader.get<uint8_t>();
+            event.index = reader.get<uint16_t>();
+            break;
+        case Type::Group:
+            event.value = reader.get<uint8_t>();
+            break;
+        case Type::Commit:
+            break;
+        case Type::WindowState:
+            event.window = reader.get<uint32_t>();
+            event.value = reader.get<uint8_t>();
+            event.index = reader.get<uint16_t>();
+            break;
+        default:
+            throw std::logic_error("Unknown record type " + std::to_string(static_cast<int>(event.type)) + " in " + path.string());
+        }
+    }
+
+    return recording;
+}
+
+template<typename T>
+void EventRecorder::put(T value)
+{
+    if (m_buffer.size() + sizeof(T) > bufferSize)
+        flush();
+
+    const auto *bytes = reinterpret_cast<const char *>(&value);
+    m_buffer.insert(m_buffer.end(), bytes, bytes + sizeof(T));
+}
+
+void EventRecorder::flush()
+{
+    size_t written = 0;
+    while (written != m_buffer.size()) {
+        const ssize_t size = write(m_fd, m_buffer.data() + written, m_buffer.size() - written);
+        if (size == -1) {
+            if (errno == EINTR)
+                continue;
+            m_buffer.clear();
+            throw std::system_error(errno, std::system_category(), "Unable to write recording");
+        }
+        written += static_cast<size_t>(size);
+    }
+    m_buffer.clear();
+}
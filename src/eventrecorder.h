@@ -0,0 +1,95 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTRECORDER_H
+#define EVENTRECORDER_H
+
+#include "keyboard.h"
+#include "keyboardcore.h"
+#include "shortcut.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include <X11/X.h>
+
+// Writes events processed by KeyboardCore and replies of its backend to a compact binary file.
+// Records are buffered and written in large chunks, the rest is written on destruction.
+class EventRecorder
+{
+public:
+    enum class Type : uint8_t {
+        Settings = 1,
+        Layouts,
+        Initialize,
+        Focus,
+        Destroy,
+        Action,
+        Group,
+        Commit,
+        WindowState, // Backend reply for a new window
+    };
+
+    struct Recording {
+        // Type-specific value is a group or an action, index is a layout index or an action index
+        struct Event {
+            Type type;
+            uint8_t value = 0;
+            uint16_t index = 0;
+            uint32_t window = None;
+        };
+
+        struct Layouts {
+            std::vector<unsigned char> groupsCounts;
+            std::vector<uint16_t> newIndices;
+        };
+
+        std::vector<Event> events;
+        std::vector<KeyboardCore::Settings> settings; // Indexed by Settings event index
+        std::vector<Layouts> layouts; // Indexed by Layouts event index
+    };
+
+    explicit EventRecorder(const std::filesystem::path &path);
+    EventRecorder(const EventRecorder &) = delete;
+    EventRecorder &operator=(const EventRecorder &) = delete;
+    ~EventRecorder();
+
+    void recordSettings(const KeyboardCore::Settings &settings);
+    void recordLayouts(const std::vector<unsigned char> &groupsCounts, const std::vector<uint16_t> &newIndices);
+    void recordInitialize(Window window, unsigned char group);
+    void recordFocus(Window window);
+    void recordDestroy(Window window);
+    void recordAction(ShortcutTable::Binding binding);
+    void recordGroup(unsigned char group);
+    void recordCommit();
+    void recordWindowState(Window window, Keyboard keyboard);
+
+    [[nodiscard]] static Recording read(const std::filesystem::path &path);
+
+private:
+    template<typename T>
+    void put(T value);
+    void flush();
+
+    std::vector<char> m_buffer;
+    int m_fd;
+};
+
+#endif // EVENTRECORDER_H
@@ -20,11 +20,11 @@
 #ifndef KEYBOARD_H
 #define KEYBOARD_H
 
-#include <cstddef>
+#include <cstdint>
 
 struct Keyboard {
     unsigned char group = 0;
-    size_t layoutIndex = 0;
+    uint16_t layoutIndex = 0;
 };
 
 #endif // KEYBOARD_H
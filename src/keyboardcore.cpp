@@ -0,0 +1,345 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "keyboardcore.h"
+
+#include "eventrecorder.h"
+#include "tracering.h"
+
+KeyboardCore::KeyboardCore(Backend &backend)
+    : m_backend(backend)
+{
+}
+
+void KeyboardCore::configure(const Settings &settings)
+{
+    if (m_recorder)
+        m_recorder->recordSettings(settings);
+
+    if (m_windows.size() == 0) {
+        m_windows = WindowTable(settings.maxWindows);
+    } else if (settings.maxWindows != m_settings.maxWindows) {
+        // Current window is moved last to protect it from eviction
+        WindowTable windows(settings.maxWindows);
+        const Window currentWindow = m_currentWindow.window();
+        m_windows.forEach([&windows, currentWindow](Window window, Keyboard &keyboard) {
+            if (window != currentWindow)
+                windows[windows.tryEmplace(window).first] = keyboard;
+        });
+        const Keyboard currentKeyboard = m_windows[m_currentWindow];
+        m_currentWindow = windows.tryEmplace(currentWindow).first;
+        windows[m_currentWindow] = currentKeyboard;
+        m_windows = std::move(windows);
+    }
+
+    m_settings = settings;
+}
+
+void KeyboardCore::setLayouts(std::vector<unsigned char> groupsCounts, const std::vector<uint16_t> &newIndices)
+{
+    if (m_recorder)
+        m_recorder->recordLayouts(groupsCounts, newIndices);
+
+    m_groupsCounts = std::move(groupsCounts);
+    if (newIndices.empty())
+        return;
+
+    const auto remap = [&newIndices](size_t layoutIndex) -> uint16_t {
+        return newIndices[layoutIndex] == removedLayout ? 0 : newIndices[layoutIndex];
+    };
+    m_windows.forEach([&remap](Window, Keyboard &keyboard) {
+        keyboard.layoutIndex = remap(keyboard.layoutIndex);
+    });
+    m_lastLayoutIndex = remap(m_lastLayoutIndex);
+    if (m_pendingLayoutIndex)
+        m_pendingLayoutIndex = remap(m_pendingLayoutIndex.value());
+
+    // Applied layout could be removed, then the layout of the current window will be applied on the next commit
+    m_applied.layoutIndex = m_applied.layoutIndex < newIndices.size() ? newIndices[m_applied.layoutIndex] : removedLayout;
+    if (m_currentWindow.window() == None)
+        return;
+    if (const uint16_t currentLayoutIndex = m_windows[m_currentWindow].layoutIndex; currentLayoutIndex != m_applied.layoutIndex)
+        setLayout(currentLayoutIndex);
+}
+
+void KeyboardCore::setRecorder(EventRecorder *recorder)
+{
+    m_recorder = recorder;
+}
+
+void KeyboardCore::setTrace(TraceRing *trace)
+{
+    m_trace = trace;
+}
+
+void KeyboardCore::initialize(Window activeWindow, unsigned char group)
+{
+    if (m_recorder)
+        m_recorder->recordInitialize(activeWindow, group);
+
+    m_applied.group = group;
+    m_currentWindow = m_windows.tryEmplace(activeWindow).first;
+    Keyboard &currentKeyboard = m_windows[m_currentWindow];
+    currentKeyboard.group = group;
+
+    Keyboard keyboard = currentKeyboard;
+    loadWindowState(activeWindow, keyboard);
+    if (m_settings.useDifferentLayouts && keyboard.layoutIndex != currentKeyboard.layoutIndex) {
+        setLayout(keyboard.layoutIndex);
+        currentKeyboard.layoutIndex = keyboard.layoutIndex;
+    }
+    if (m_settings.useDifferentGroups && keyboard.group != currentKeyboard.group) {
+        setGroup(keyboard.group);
+        currentKeyboard.group = keyboard.group;
+    }
+    m_backend.windowChanged(activeWindow, currentKeyboard);
+}
+
+void KeyboardCore::activateWindow(Window window)
+{
+    if (m_recorder)
+        m_recorder->recordFocus(window);
+
+    // Access current window first to protect it from eviction
+    const Keyboard currentKeyboard = m_windows[m_currentWindow];
+    const auto [newWindow, inserted] = m_windows.tryEmplace(window);
+
+    Keyboard &newKeyboard = m_windows[newWindow];
+    if (inserted)
+        loadWindowState(window, newKeyboard);
+
+    if (m_settings.useDifferentLayouts) {
+        if (newKeyboard.layoutIndex != currentKeyboard.layoutIndex)
+            setLayout(newKeyboard.layoutIndex);
+    } else {
+        newKeyboard.layoutIndex = currentKeyboard.layoutIndex;
+    }
+
+    if (m_settings.useDifferentGroups) {
+        if (newKeyboard.group != currentKeyboard.group)
+            setGroup(newKeyboard.group);
+    } else {
+        newKeyboard.group = currentKeyboard.group;
+    }
+
+    m_backend.groupChanged(newKeyboard.layoutIndex, newKeyboard.group);
+    m_backend.windowChanged(window, newKeyboard);
+
+    if (m_currentWindowDestroyed) {
+        m_windows.erase(m_currentWindow.window());
+        m_currentWindowDestroyed = false;
+    }
+    m_currentWindow = newWindow;
+}
+
+void KeyboardCore::destroyWindow(Window window)
+{
+    if (m_recorder)
+        m_recorder->recordDestroy(window);
+
+    m_backend.windowDestroyed(window);
+
+    // Current window state is needed until the next window is activated
+    if (window == m_currentWindow.window()) {
+        m_currentWindowDestroyed = true;
+        return;
+    }
+
+    m_windows.erase(window);
+}
+
+void KeyboardCore::processAction(ShortcutTable::Binding binding)
+{
+    if (m_recorder)
+        m_recorder->recordAction(binding);
+
+    const Keyboard currentKeyboard = m_windows[m_currentWindow];
+    switch (binding.action) {
+    case ShortcutTable::Action::NextLayout: {
+        const size_t layoutIndex = currentKeyboard.layoutIndex + 1;
+        switchLayout(layoutIndex < m_groupsCounts.size() ? layoutIndex : 0);
+        break;
+    }
+    case ShortcutTable::Action::PreviousLayout:
+        switchLayout(currentKeyboard.layoutIndex != 0 ? currentKeyboard.layoutIndex - 1 : m_groupsCounts.size() - 1);
+        break;
+    case ShortcutTable::Action::LastLayout:
+        switchLayout(m_lastLayoutIndex);
+        break;
+    case ShortcutTable::Action::SetLayout:
+        switchLayout(binding.index);
+        break;
+    case ShortcutTable::Action::SetGroup:
+        switchGroup(static_cast<unsigned char>(binding.index));
+        break;
+    case ShortcutTable::Action::NextGroup:
+        switchGroup(static_cast<unsigned char>((currentKeyboard.group + 1) % m_groupsCounts[currentKeyboard.layoutIndex]));
+        break;
+    }
+}
+
+void KeyboardCore::saveGroup(unsigned char group)
+{
+    if (m_recorder)
+        m_recorder->recordGroup(group);
+
+    // Groups locked by the backend are reported too
+    if (group == m_applied.group) {
+        if (m_trace)
+            m_trace->instant(TraceRing::Event::IgnoredGroupSave, m_currentWindow.window(), group);
+        return;
+    }
+    m_applied.group = group;
+
+    // Group was switched by user, it takes precedence over the pending one
+    m_pendingGroup.reset();
+    Keyboard &currentKeyboard = m_windows[m_currentWindow];
+    currentKeyboard.group = group;
+    m_backend.windowChanged(m_currentWindow.window(), currentKeyboard);
+    m_backend.groupChanged(currentKeyboard.layoutIndex, group);
+}
+
+bool KeyboardCore::hasPendingChanges() const
+{
+    return m_pendingLayoutIndex || m_pendingGroup;
+}
+
+std::chrono::steady_clock::time_point KeyboardCore::commitTime() const
+{
+    return m_commitTime;
+}
+
+void KeyboardCore::commit()
+{
+    if (m_recorder)
+        m_recorder->recordCommit();
+
+    // Layouts with the same groups could share a keymap in another order, so the group is locked again after a layout change
+    bool layoutChanged = false;
+    if (m_pendingLayoutIndex && m_pendingLayoutIndex.value() != m_applied.layoutIndex) {
+        m_backend.applyLayout(m_pendingLayoutIndex.value());
+        m_applied.layoutIndex = static_cast<uint16_t>(m_pendingLayoutIndex.value());
+        layoutChanged = true;
+    }
+
+    if (const unsigned char group = m_pendingGroup.value_or(m_applied.group); layoutChanged || group != m_applied.group) {
+        m_backend.lockGroup(group);
+        m_applied.group = group;
+    }
+
+    m_pendingLayoutIndex.reset();
+    m_pendingGroup.reset();
+}
+
+const KeyboardCore::Settings &KeyboardCore::settings() const
+{
+    return m_settings;
+}
+
+size_t KeyboardCore::layoutsCount() const
+{
+    return m_groupsCounts.size();
+}
+
+Keyboard KeyboardCore::currentKeyboard()
+{
+    return m_windows[m_currentWindow];
+}
+
+Window KeyboardCore::currentWindow() const
+{
+    return m_currentWindow.window();
+}
+
+uint16_t KeyboardCore::appliedLayoutIndex() const
+{
+    return m_applied.layoutIndex;
+}
+
+unsigned char KeyboardCore::appliedGroup() const
+{
+    return m_applied.group;
+}
+
+std::vector<Window> KeyboardCore::windows() const
+{
+    return m_windows.windows();
+}
+
+size_t KeyboardCore::windowsCount() const
+{
+    return m_windows.size();
+}
+
+void KeyboardCore::loadWindowState(Window window, Keyboard &keyboard)
+{
+    m_backend.windowCreated(window, keyboard);
+    if (m_recorder)
+        m_recorder->recordWindowState(window, keyboard);
+}
+
+void KeyboardCore::switchLayout(size_t layoutIndex)
+{
+    Keyboard &currentKeyboard = m_windows[m_currentWindow];
+    if (layoutIndex == currentKeyboard.layoutIndex)
+        return;
+
+    m_lastLayoutIndex = currentKeyboard.layoutIndex;
+    setLayout(layoutIndex);
+
+    if (m_settings.defaultGroup && currentKeyboard.group != m_settings.defaultGroup.value()) {
+        setGroup(m_settings.defaultGroup.value());
+        currentKeyboard.group = m_settings.defaultGroup.value();
+    }
+    currentKeyboard.layoutIndex = static_cast<uint16_t>(layoutIndex);
+
+    m_backend.groupChanged(layoutIndex, currentKeyboard.group);
+    m_backend.windowChanged(m_currentWindow.window(), currentKeyboard);
+}
+
+void KeyboardCore::switchGroup(unsigned char group)
+{
+    Keyboard &currentKeyboard = m_windows[m_currentWindow];
+    if (group == currentKeyboard.group)
+        return;
+
+    setGroup(group);
+    currentKeyboard.group = group;
+
+    m_backend.groupChanged(currentKeyboard.layoutIndex, group);
+    m_backend.windowChanged(m_currentWindow.window(), currentKeyboard);
+}
+
+void KeyboardCore::setLayout(size_t layoutIndex)
+{
+    if (!hasPendingChanges())
+        m_commitTime = std::chrono::steady_clock::now() + m_settings.commitDelay;
+    m_pendingLayoutIndex = layoutIndex;
+    if (m_trace)
+        m_trace->instant(TraceRing::Event::SetLayout, None, static_cast<uint16_t>(layoutIndex));
+}
+
+void KeyboardCore::setGroup(unsigned char group)
+{
+    if (!hasPendingChanges())
+        m_commitTime = std::chrono::steady_clock::now() + m_settings.commitDelay;
+    m_pendingGroup = group;
+    if (m_trace)
+        m_trace->instant(TraceRing::Event::SetGroup, None, group);
+}
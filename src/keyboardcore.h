@@ -0,0 +1,123 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef KEYBOARDCORE_H
+#define KEYBOARDCORE_H
+
+#include "keyboard.h"
+#include "shortcut.h"
+#include "windowtable.h"
+
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include <X11/X.h>
+
+class EventRecorder;
+class TraceRing;
+
+// Keyboard state of windows and pending changes. X server, state file and output are reached only through the backend,
+// so recorded events can be replayed without them.
+class KeyboardCore
+{
+public:
+    class Backend
+    {
+    public:
+        virtual ~Backend() = default;
+
+        // Loads the initial state of the new window, e.g. from rules
+        virtual void windowCreated(Window window, Keyboard &keyboard) = 0;
+        virtual void windowChanged(Window window, Keyboard keyboard) = 0;
+        virtual void windowDestroyed(Window window) = 0;
+        // Called for the current window before the changes are committed
+        virtual void groupChanged(size_t layoutIndex, unsigned char group) = 0;
+
+        virtual void applyLayout(size_t layoutIndex) = 0;
+        virtual void lockGroup(unsigned char group) = 0;
+    };
+
+    struct Settings {
+        std::optional<unsigned char> defaultGroup;
+        std::chrono::milliseconds commitDelay{0};
+        size_t maxWindows = 0;
+        bool useDifferentGroups = false;
+        bool useDifferentLayouts = false;
+    };
+
+    // Marks layouts without a new index, their windows switch to the first layout
+    static constexpr uint16_t removedLayout = std::numeric_limits<uint16_t>::max();
+
+    explicit KeyboardCore(Backend &backend);
+
+    void configure(const Settings &settings);
+    // New layouts are described by their groups counts, newIndices maps old layout indices to new ones
+    void setLayouts(std::vector<unsigned char> groupsCounts, const std::vector<uint16_t> &newIndices = {});
+    void setRecorder(EventRecorder *recorder);
+    void setTrace(TraceRing *trace);
+
+    void initialize(Window activeWindow, unsigned char group);
+    void activateWindow(Window window);
+    void destroyWindow(Window window);
+    void processAction(ShortcutTable::Binding binding);
+    // Group change reported by X server
+    void saveGroup(unsigned char group);
+
+    // Layout and group changes are committed only after processing all events
+    [[nodiscard]] bool hasPendingChanges() const;
+    [[nodiscard]] std::chrono::steady_clock::time_point commitTime() const;
+    void commit();
+
+    [[nodiscard]] const Settings &settings() const;
+    [[nodiscard]] size_t layoutsCount() const;
+    [[nodiscard]] Keyboard currentKeyboard();
+    [[nodiscard]] Window currentWindow() const;
+    [[nodiscard]] uint16_t appliedLayoutIndex() const;
+    [[nodiscard]] unsigned char appliedGroup() const;
+    [[nodiscard]] std::vector<Window> windows() const;
+    [[nodiscard]] size_t windowsCount() const;
+
+private:
+    void loadWindowState(Window window, Keyboard &keyboard);
+    void switchLayout(size_t layoutIndex);
+    void switchGroup(unsigned char group);
+    void setLayout(size_t layoutIndex);
+    void setGroup(unsigned char group);
+
+    Backend &m_backend;
+    EventRecorder *m_recorder = nullptr;
+    TraceRing *m_trace = nullptr;
+
+    Settings m_settings;
+    std::vector<unsigned char> m_groupsCounts;
+    WindowTable m_windows;
+    WindowTable::Handle m_currentWindow;
+    bool m_currentWindowDestroyed = false;
+    Keyboard m_applied;
+    uint16_t m_lastLayoutIndex = 0; // Layout before the last switch by shortcut
+
+    std::optional<size_t> m_pendingLayoutIndex;
+    std::optional<unsigned char> m_pendingGroup;
+    std::chrono::steady_clock::time_point m_commitTime;
+};
+
+#endif // KEYBOARDCORE_H
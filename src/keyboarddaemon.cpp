@@ -21,23 +21,84 @@
 
 #include "keyboardsymbols.h"
 #include "parameters.h"
+#include "xrequests.h"
 
 #include <boost/algorithm/string/join.hpp>
 #include <boost/program_options.hpp>
 #include <boost/spirit/home/x3.hpp>
 #include <boost/tokenizer.hpp>
 
+#include <algorithm>
+#include <array>
 #include <iostream>
+#include <limits>
+#include <system_error>
 
+#include <csignal>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <X11/Xatom.h>
+#include <X11/Xproto.h>
 #include <X11/extensions/XKBrules.h>
+#ifdef WITH_XINPUT
+#include <X11/extensions/XInput2.h>
+#endif
+
+// In 32-bit units
+static constexpr long windowPropertyLength = 64;
+static constexpr long clientListLength = 1 << 20;
+
+static constexpr std::chrono::minutes reconcileInterval(5);
+
+// Event loop sources
+static constexpr uint32_t displaySource = 0;
+static constexpr uint32_t serverSource = 1;
+static constexpr uint32_t outputSource = 2;
+static constexpr uint32_t settingsSource = 3;
+static constexpr uint32_t keymapSource = 4;
+static_assert(keymapSource < KeyboardDaemon::sourcesCount);
+
+// About 1.5 MiB, enough for several minutes of active use
+static constexpr size_t traceCapacity = 1 << 16;
+
+static XErrorHandler defaultErrorHandler;
+
+// Windows could be destroyed before requests to them are processed
+static int ignoreBadWindow(Display *display, XErrorEvent *event)
+{
+    if (event->error_code == BadWindow)
+        return 0;
+    // Keys of the next layout are grabbed without a round trip on switch
+    if (event->error_code == BadAccess && event->request_code == X_GrabKey) {
+        std::cerr << "Shortcut key is already grabbed by another application" << std::endl;
+        return 0;
+    }
+    return defaultErrorHandler(display, event);
+}
 
-KeyboardDaemon::KeyboardDaemon(const Parameters &parameters)
+// The default handler exits before the exit handler of the display is called, the loss is reported by the owner
+static int ignoreIOError(Display *)
+{
+    return 0;
+}
+
+KeyboardDaemon::KeyboardDaemon(const Parameters &parameters, const char *displayName, EventLoop *sharedEventLoop, uint32_t sourcesBase)
+    : m_display(XkbOpenDisplay(displayName, &m_xkbEventType, nullptr, nullptr, nullptr, nullptr))
+    , m_displayName(displayName ? displayName : std::string())
+    , m_sourcesBase(sourcesBase)
 {
     if (!m_display)
-        throw std::logic_error("Unable to connect to X server");
+        throw std::logic_error("Unable to connect to X server " + m_displayName);
+
+    // Xlib exits on connection loss by default, but other displays of the process should keep working
+    if (sharedEventLoop) {
+        XSetIOErrorHandler(ignoreIOError);
+        XSetIOErrorExitHandler(m_display.get(), setDisconnected, this);
+    }
 
     if (parameters.isPrintCurrentGroup()) {
-        printGroupFromKeyboardRules(currentGroup());
+        printGroupFromKeyboardRules();
         m_needProcessEvents = false;
         return;
     }
@@ -48,33 +109,75 @@ KeyboardDaemon::KeyboardDaemon(const Parameters &parameters)
         return;
     }
 
-    if (std::optional<unsigned char> group = parameters.groupToSet(); group) {
-        setGroup(group.value());
+    if (std::optional<unsigned> group = parameters.groupToSet(); group) {
+        // Validated the same way as the set-group socket command
+        if (group.value() >= XkbNumKbdGroups)
+            throw std::logic_error("Group index is out of range");
+        lockGroup(static_cast<unsigned char>(group.value()));
         m_needProcessEvents = false;
         return;
     }
 
     if (parameters.isSwitchToNextGroup()) {
-        setGroup(currentGroup() + 1);
+        lockGroup(currentGroup() + 1);
         m_needProcessEvents = false;
         return;
     }
 
+    // Handler is shared by all displays
+    if (!defaultErrorHandler)
+        defaultErrorHandler = XSetErrorHandler(ignoreBadWindow);
     m_root = XDefaultRootWindow(m_display.get());
-    m_activeWindowProperty = XInternAtom(m_display.get(), "_NET_ACTIVE_WINDOW", false);
-    m_windows.emplace(activeWindow(), Keyboard());
-    m_currentWindow = m_windows.begin();
+    AtomRequest activeWindowAtomRequest(*m_display, "_NET_ACTIVE_WINDOW");
+    AtomRequest clientListAtomRequest(*m_display, "_NET_CLIENT_LIST");
+    m_activeWindowProperty = activeWindowAtomRequest.reply();
+    m_clientListProperty = clientListAtomRequest.reply();
 
+    // Active window is independent from layouts, so its reply will arrive while parameters are loading
+    PropertyRequest activeWindowRequest(*m_display, m_root, m_activeWindowProperty);
     loadParameters(parameters);
 
     XkbSelectEventDetails(m_display.get(), XkbUseCoreKbd, XkbStateNotify, XkbAllStateComponentsMask, XkbGroupStateMask);
-    if (m_useDifferentGroups || m_useDifferentLayouts)
-        XSelectInput(m_display.get(), m_root, PropertyChangeMask | SubstructureNotifyMask); // Listen for current window change events
+#ifdef WITH_XINPUT
+    if (m_perDevice)
+        updateDevices(activeWindow(activeWindowRequest));
+    else
+#endif
+        m_core.initialize(activeWindow(activeWindowRequest), currentGroup());
+    selectWindowEvents();
 
-    saveCurrentGroup();
+    // Output is polled only if writing to it could block
+    m_eventLoop = sharedEventLoop ? sharedEventLoop : &m_ownEventLoop.emplace();
+    m_eventLoop->add(ConnectionNumber(m_display.get()), EPOLLIN, m_sourcesBase + displaySource);
+    if (m_server)
+        m_eventLoop->add(m_server->fd(), EPOLLIN, m_sourcesBase + serverSource);
+    if (m_output)
+        m_eventLoop->add(m_output->fd(), EPOLLOUT | EPOLLET, m_sourcesBase + outputSource);
+    if (m_settingsWatcher)
+        m_eventLoop->add(m_settingsWatcher->fd(), EPOLLIN, m_sourcesBase + settingsSource);
+    if (m_keymapWorker)
+        m_eventLoop->add(m_keymapWorker->fd(), EPOLLIN, m_sourcesBase + keymapSource);
+
+    printCurrentGroup();
     m_needProcessEvents = true;
 }
 
+KeyboardDaemon::~KeyboardDaemon()
+{
+    Layout::forgetKeyboardRules(*m_display);
+    if (!m_eventLoop || m_ownEventLoop)
+        return;
+
+    // Shared loop outlives the daemon
+    m_eventLoop->remove(ConnectionNumber(m_display.get()));
+    if (m_server)
+        m_eventLoop->remove(m_server->fd());
+    if (m_settingsWatcher)
+        m_eventLoop->remove(m_settingsWatcher->fd());
+    if (m_keymapWorker)
+        m_eventLoop->remove(m_keymapWorker->fd());
+}
+
 bool KeyboardDaemon::needProcessEvents() const
 {
     return m_needProcessEvents;
@@ -82,11 +185,60 @@ bool KeyboardDaemon::needProcessEvents() const
 
 void KeyboardDaemon::processEvents()
 {
-    XkbEvent event;
+    static const std::vector<uint32_t> noSources;
 
     while (true) {
-        XNextEvent(m_display.get(), &event.core);
+        // Also flushes requests from the previous commit
+        const std::vector<uint32_t> *sources = &noSources;
+        if (!hasQueuedEvents()) {
+            m_eventLoop->setDeadline(nextDeadline());
+            sources = &m_eventLoop->wait();
+            if (m_eventLoop->isTerminated())
+                return;
+            if (m_eventLoop->takeUserSignal(SIGUSR1))
+                printStatistics();
+            if (m_eventLoop->takeUserSignal(SIGUSR2))
+                saveTrace();
+        }
+
+        processBatch(*sources);
+    }
+}
+
+bool KeyboardDaemon::hasQueuedEvents() const
+{
+    return XPending(m_display.get());
+}
+
+void KeyboardDaemon::processBatch(const std::vector<uint32_t> &sources)
+{
+    bool hasRequests = false;
+    bool reloadSettings = false;
+    for (const uint32_t source : sources) {
+        if (source == serverSource)
+            hasRequests = true;
+        else if (source == outputSource)
+            m_output->flush();
+        else if (source == settingsSource && m_settingsWatcher->processEvents())
+            reloadSettings = true;
+        else if (source == keymapSource)
+            takePreparedKeymaps();
+    }
 
+    m_events.clear();
+    while (XPending(m_display.get())) {
+        XEvent &event = m_events.emplace_back().core;
+        XNextEvent(m_display.get(), &event);
+#ifdef WITH_XINPUT
+        // Xlib frees unclaimed cookie data on the next XNextEvent
+        if (event.type == GenericEvent)
+            readDeviceEvent(event.xcookie);
+#endif
+    }
+    m_eventsCount += m_events.size();
+
+    skipSupersededFocusChanges(m_events);
+    for (XkbEvent &event : m_events) {
         switch (event.type) {
         case DestroyNotify:
             removeDestroyedWindow(event.core.xdestroywindow);
@@ -97,11 +249,79 @@ void KeyboardDaemon::processEvents()
         case KeyPress:
             processShortcuts(event.core.xkey);
             break;
+        case MappingNotify:
+            updateKeyboardMapping(event.core.xmapping);
+            break;
+#ifdef WITH_XINPUT
+        case GenericEvent:
+            processDeviceEvent(event.core.xcookie);
+            break;
+#endif
         default:
             if (event.type == m_xkbEventType)
                 saveCurrentGroup(event.state);
         }
     }
+
+    if (hasRequests)
+        processRequests();
+
+    // Invalid settings shouldn't stop the daemon
+    if (reloadSettings) {
+        try {
+            reloadParameters();
+        } catch (const std::exception &error) {
+            std::cerr << "Unable to reload settings: " << error.what() << std::endl;
+        }
+    }
+
+    // Commit only the latest changes once the queue is drained
+    const auto now = std::chrono::steady_clock::now();
+    forEachCore([now](KeyboardCore &core) {
+        if (core.hasPendingChanges() && now >= core.commitTime())
+            core.commit();
+    });
+    if (m_reconcileTime && now >= m_reconcileTime.value())
+        reconcileWindows();
+}
+
+void KeyboardDaemon::printStatistics() const
+{
+    if (!m_displayName.empty())
+        std::cerr << "Display " << m_displayName << ":\n";
+    std::cerr << m_statistics.text(statisticsCounters()) << std::flush;
+}
+
+void KeyboardDaemon::saveTrace() const
+{
+    if (!m_trace)
+        return;
+
+    try {
+        m_trace->save(m_traceFile);
+    } catch (const std::exception &error) {
+        std::cerr << error.what() << std::endl;
+    }
+}
+
+bool KeyboardDaemon::isConnected() const
+{
+    // Xlib notices the broken connection when it checks for events
+    if (!m_disconnected)
+        XPending(m_display.get());
+    return !m_disconnected;
+}
+
+Statistics::Counters KeyboardDaemon::statisticsCounters() const
+{
+    return {
+        m_eventsCount,
+        repliesCount(),
+        activeCore().windowsCount(),
+        m_skippedFocusChanges,
+        m_staleWindowsRemoved,
+        m_output ? m_output->droppedLinesCount() : 0,
+    };
 }
 
 Display &KeyboardDaemon::display() const
@@ -114,176 +334,934 @@ Window KeyboardDaemon::root() const
     return m_root;
 }
 
-void KeyboardDaemon::switchToNextLayout()
+void KeyboardDaemon::applyWindowLayout(const XPropertyEvent &event)
+{
+    if (event.state != PropertyNewValue || event.atom != m_activeWindowProperty)
+        return;
+
+    const Statistics::Timer timer(m_statistics, Statistics::Handler::FocusChange);
+    TraceRing::Span span(m_trace, TraceRing::Event::FocusChange);
+    const Window window = activeWindow(PropertyRequest(*m_display, m_root, m_activeWindowProperty));
+    span.setWindow(window);
+    forEachCore([window](KeyboardCore &core) {
+        core.activateWindow(window);
+    });
+}
+
+void KeyboardDaemon::removeDestroyedWindow(const XDestroyWindowEvent &event)
 {
-    size_t layoutIndex = m_currentWindow->second.layoutIndex + 1;
-    if (layoutIndex >= m_layouts.size())
-        layoutIndex = 0;
+    const Statistics::Timer timer(m_statistics, Statistics::Handler::WindowDestroy);
+    const TraceRing::Span span(m_trace, TraceRing::Event::WindowDestroy, event.window);
+    forEachCore([&event](KeyboardCore &core) {
+        core.destroyWindow(event.window);
+    });
+}
 
-    setLayout(layoutIndex);
+void KeyboardDaemon::processShortcuts(const XKeyEvent &event)
+{
+    const TraceRing::Span span(m_trace, TraceRing::Event::ShortcutKey, activeCore().currentWindow(), static_cast<uint16_t>(event.keycode));
+    const ShortcutTable::Binding *binding = m_shortcuts.find(event);
+    if (!binding)
+        return;
 
-    if (m_defaultGroup && m_currentWindow->second.group != m_defaultGroup.value()) {
-        setGroup(m_defaultGroup.value());
-        printGroupIfDifferent(m_defaultGroup.value(), layoutIndex);
+    const Statistics::Timer timer(m_statistics, Statistics::Handler::Shortcut);
+    activeCore().processAction(*binding);
+}
 
-        m_currentWindow->second.group = m_defaultGroup.value();
-    } else {
-        printGroupIfDifferent(m_currentWindow->second.group, layoutIndex);
+void KeyboardDaemon::processRequests()
+{
+    const Statistics::Timer timer(m_statistics, Statistics::Handler::Request);
+    m_requests.clear();
+    m_server->processEvents(m_requests);
+
+    KeyboardCore &core = activeCore();
+    for (const Server::Request &request : m_requests) {
+        const TraceRing::Span span(m_trace, TraceRing::Event::Request, None, static_cast<uint16_t>(request.command));
+        switch (request.command) {
+        case Server::Command::GetGroup: {
+            // Same token as printed by -c without the daemon
+            const Keyboard currentKeyboard = core.currentKeyboard();
+            m_server->reply(request.client, m_layouts[currentKeyboard.layoutIndex].groupCode(currentKeyboard.group));
+            break;
+        }
+        case Server::Command::GetGroupIndex:
+            m_server->reply(request.client, std::to_string(core.currentKeyboard().group));
+            break;
+        case Server::Command::Subscribe: {
+            const Keyboard currentKeyboard = core.currentKeyboard();
+            m_server->reply(request.client, m_layouts[currentKeyboard.layoutIndex].groupName(currentKeyboard.group));
+            m_server->subscribe(request.client);
+            break;
+        }
+        case Server::Command::SetGroup:
+            if (request.index >= XkbNumKbdGroups) {
+                m_server->reply(request.client, "error: group index is out of range");
+                break;
+            }
+            core.processAction({ShortcutTable::Action::SetGroup, static_cast<uint16_t>(request.index)});
+            m_server->reply(request.client, "ok");
+            break;
+        case Server::Command::NextGroup:
+            core.processAction({ShortcutTable::Action::NextGroup});
+            m_server->reply(request.client, "ok");
+            break;
+        case Server::Command::SetLayout:
+            if (request.index >= m_layouts.size()) {
+                m_server->reply(request.client, "error: layout index is out of range");
+                break;
+            }
+            core.processAction({ShortcutTable::Action::SetLayout, static_cast<uint16_t>(request.index)});
+            m_server->reply(request.client, "ok");
+            break;
+        case Server::Command::NextLayout:
+            core.processAction({ShortcutTable::Action::NextLayout});
+            m_server->reply(request.client, "ok");
+            break;
+        case Server::Command::PreviousLayout:
+            core.processAction({ShortcutTable::Action::PreviousLayout});
+            m_server->reply(request.client, "ok");
+            break;
+        case Server::Command::GetStatistics:
+            m_server->reply(request.client, m_statistics.json(statisticsCounters()));
+            break;
+        case Server::Command::DumpTrace:
+            if (!m_trace) {
+                m_server->reply(request.client, "error: tracing is disabled");
+                break;
+            }
+            try {
+                m_trace->save(m_traceFile);
+                m_server->reply(request.client, m_traceFile.native());
+            } catch (const std::exception &error) {
+                m_server->reply(request.client, std::string("error: ") + error.what());
+            }
+            break;
+        }
     }
+}
+
+void KeyboardDaemon::updateKeyboardMapping(XMappingEvent &event)
+{
+    const TraceRing::Span span(m_trace, TraceRing::Event::KeymapChange);
+    XRefreshKeyboardMapping(&event);
+    if (event.request != MappingKeyboard || m_shortcuts.empty())
+        return;
+
+    // Keymaps of compiled layouts are uploaded by akd, so their keycodes are already known
+    const uint16_t appliedLayoutIndex = activeCore().appliedLayoutIndex();
+    if (appliedLayoutIndex >= m_layouts.size())
+        return;
+    Layout &layout = m_layouts[appliedLayoutIndex];
+    if (layout.refreshKeys(event.first_keycode, event.count))
+        m_shortcuts.refreshLayout(layout, appliedLayoutIndex);
+}
 
-    m_currentWindow->second.layoutIndex = layoutIndex;
+void KeyboardDaemon::setDisconnected([[maybe_unused]] Display *display, void *daemon)
+{
+    // Xlib doesn't exit if this handler returns, further requests to the display fail without waiting
+    static_cast<KeyboardDaemon *>(daemon)->m_disconnected = true;
 }
 
-void KeyboardDaemon::applyWindowLayout(const XPropertyEvent &event)
+void KeyboardDaemon::saveCurrentGroup(const XkbStateNotifyEvent &event)
 {
-    if (event.state != PropertyNewValue || event.atom != m_activeWindowProperty)
+    const Statistics::Timer timer(m_statistics, Statistics::Handler::GroupChange);
+    // Group of a device is reported for the device and for its master, state of masters isn't tracked
+    KeyboardCore *core = &m_core;
+    if (m_perDevice) {
+        if (static_cast<unsigned>(event.device) >= m_devices.size() || !m_devices[event.device])
+            return;
+        core = &m_devices[event.device]->core;
+    }
+
+    const TraceRing::Span span(m_trace, TraceRing::Event::GroupChange, core->currentWindow(), static_cast<uint16_t>(event.group));
+    core->saveGroup(layoutGroup(core->appliedLayoutIndex(), static_cast<unsigned char>(event.group)));
+}
+
+void KeyboardDaemon::windowCreated(Window window, Keyboard &keyboard)
+{
+    if (activeCore().settings().useDifferentGroups || activeCore().settings().useDifferentLayouts)
+        trackWindow(window);
+    if (!m_stateFile && m_windowRules.empty())
+        return;
+
+    if (const std::optional<uint32_t> classHash = loadInitialState(window, keyboard); classHash)
+        m_createdWindowClass.emplace(window, classHash.value());
+}
+
+void KeyboardDaemon::windowChanged(Window window, Keyboard keyboard)
+{
+    if (!m_stateFile)
         return;
 
-    const auto [newWindow, inserted] = m_windows.try_emplace(activeWindow());
-    if (m_useDifferentLayouts) {
-        if (newWindow->second.layoutIndex != m_currentWindow->second.layoutIndex)
-            setLayout(newWindow->second.layoutIndex);
+    if (m_createdWindowClass && m_createdWindowClass->first == window) {
+        m_stateFile->saveWindow(window, m_createdWindowClass->second, keyboard);
+        m_createdWindowClass.reset();
     } else {
-        newWindow->second.layoutIndex = m_currentWindow->second.layoutIndex;
+        m_stateFile->updateWindow(window, keyboard);
     }
+}
 
-    if (m_useDifferentGroups) {
-        if (newWindow->second.group != m_currentWindow->second.group)
-            setGroup(newWindow->second.group);
-    } else {
-        newWindow->second.group = m_currentWindow->second.group;
+void KeyboardDaemon::windowDestroyed(Window window)
+{
+    if (m_stateFile)
+        m_stateFile->eraseWindow(window);
+}
+
+void KeyboardDaemon::groupChanged(size_t layoutIndex, unsigned char group)
+{
+    printGroupIfDifferent(group, layoutIndex);
+}
+
+void KeyboardDaemon::applyLayout(size_t layoutIndex)
+{
+    applyLayout(layoutIndex, XkbUseCoreKbd, m_core);
+}
+
+void KeyboardDaemon::lockGroup(unsigned char group)
+{
+    lockGroup(group, XkbUseCoreKbd, m_core);
+}
+
+void KeyboardDaemon::applyLayout(size_t layoutIndex, unsigned deviceSpec, const KeyboardCore &core)
+{
+    // Keymap is uploaded only if the groups change, the group is locked by the core afterwards
+    const size_t keymapIndex = m_keymaps[layoutIndex].layoutIndex;
+    if (const uint16_t appliedLayoutIndex = core.appliedLayoutIndex(); appliedLayoutIndex >= m_keymaps.size() || m_keymaps[appliedLayoutIndex].layoutIndex != keymapIndex) {
+        const Statistics::Timer timer(m_statistics, Statistics::Handler::LayoutApply);
+        const TraceRing::Span span(m_trace, TraceRing::Event::LayoutApply, core.currentWindow(), static_cast<uint16_t>(layoutIndex));
+        m_layouts[keymapIndex].apply(deviceSpec);
     }
 
-    printGroupIfDifferent(newWindow->second.group, newWindow->second.layoutIndex);
-    m_currentWindow = newWindow;
+    // Shortcuts are grabbed with keycodes of the last used device
+    if (!m_perDevice || deviceSpec == m_activeDevice)
+        m_shortcuts.switchLayout(m_layouts[keymapIndex], layoutIndex);
+    prepareKeymaps(layoutIndex);
 }
 
-void KeyboardDaemon::removeDestroyedWindow(const XDestroyWindowEvent &event)
+void KeyboardDaemon::lockGroup(unsigned char group, unsigned deviceSpec, const KeyboardCore &core)
 {
-    m_windows.erase(event.window);
+    if (m_trace)
+        m_trace->instant(TraceRing::Event::LockGroup, core.currentWindow(), group);
+    if (!XkbLockGroup(m_display.get(), deviceSpec, keymapGroup(core.appliedLayoutIndex(), group)))
+        throw std::logic_error("Unable to switch group to " + std::to_string(group));
 }
 
-void KeyboardDaemon::processShortcuts(const XKeyEvent &event)
+KeyboardDaemon::DeviceBackend::DeviceBackend(KeyboardDaemon &daemon, unsigned id)
+    : m_daemon(daemon)
+    , m_id(id)
 {
-    for (const Shortcut &shortcut : m_shortcuts)
-        shortcut.processEvent(event);
 }
 
-void KeyboardDaemon::saveCurrentGroup(const XkbStateNotifyEvent &event)
+void KeyboardDaemon::DeviceBackend::windowCreated(Window window, Keyboard &keyboard)
+{
+    std::optional<std::pair<Window, Keyboard>> &createdWindowState = m_daemon.m_createdWindowState;
+    if (createdWindowState && createdWindowState->first == window) {
+        keyboard = createdWindowState->second;
+        return;
+    }
+
+    m_daemon.windowCreated(window, keyboard);
+    createdWindowState.emplace(window, keyboard);
+}
+
+void KeyboardDaemon::DeviceBackend::windowChanged(Window window, Keyboard keyboard)
+{
+    if (isActive())
+        m_daemon.windowChanged(window, keyboard);
+}
+
+void KeyboardDaemon::DeviceBackend::windowDestroyed(Window window)
+{
+    if (m_daemon.m_createdWindowState && m_daemon.m_createdWindowState->first == window)
+        m_daemon.m_createdWindowState.reset();
+    if (isActive())
+        m_daemon.windowDestroyed(window);
+}
+
+void KeyboardDaemon::DeviceBackend::groupChanged(size_t layoutIndex, unsigned char group)
+{
+    if (isActive())
+        m_daemon.groupChanged(layoutIndex, group);
+}
+
+void KeyboardDaemon::DeviceBackend::applyLayout(size_t layoutIndex)
+{
+    m_daemon.applyLayout(layoutIndex, m_id, core());
+}
+
+void KeyboardDaemon::DeviceBackend::lockGroup(unsigned char group)
+{
+    m_daemon.lockGroup(group, m_id, core());
+}
+
+bool KeyboardDaemon::DeviceBackend::isActive() const
+{
+    return m_id == m_daemon.m_activeDevice;
+}
+
+const KeyboardCore &KeyboardDaemon::DeviceBackend::core() const
+{
+    // Device is stored before its core is initialized
+    return m_daemon.m_devices[m_id]->core;
+}
+
+KeyboardDaemon::Device::Device(KeyboardDaemon &daemon, unsigned id)
+    : backend(daemon, id)
+    , core(backend)
+{
+}
+
+#ifdef WITH_XINPUT
+void KeyboardDaemon::selectDeviceEvents()
+{
+    int event;
+    int error;
+    if (!XQueryExtension(m_display.get(), "XInputExtension", &m_xinputOpcode, &event, &error))
+        throw std::logic_error("XInput extension is not available");
+
+    // Raw events from all devices are delivered to root window since 2.1
+    int major = 2;
+    int minor = 1;
+    if (XIQueryVersion(m_display.get(), &major, &minor) != Success || (major == 2 && minor < 1))
+        throw std::logic_error("XInput 2.1 is required to track devices");
+
+    std::array<unsigned char, XIMaskLen(XI_RawKeyPress)> mask{};
+    XISetMask(mask.data(), XI_HierarchyChanged);
+    XISetMask(mask.data(), XI_RawKeyPress);
+    XIEventMask eventMask{XIAllDevices, static_cast<int>(mask.size()), mask.data()};
+    XISelectEvents(m_display.get(), m_root, &eventMask, 1);
+}
+
+void KeyboardDaemon::readDeviceEvent(XGenericEventCookie &cookie)
+{
+    if (cookie.extension != m_xinputOpcode || !XGetEventData(m_display.get(), &cookie)) {
+        cookie.evtype = 0;
+        return;
+    }
+
+    // Only the source device is needed, it's kept in place of the freed cookie
+    const int sourceId = cookie.evtype == XI_RawKeyPress ? static_cast<const XIRawEvent *>(cookie.data)->sourceid : 0;
+    XFreeEventData(m_display.get(), &cookie);
+    cookie.cookie = static_cast<unsigned>(sourceId);
+}
+
+void KeyboardDaemon::processDeviceEvent(const XGenericEventCookie &cookie)
+{
+    if (cookie.evtype == XI_RawKeyPress)
+        activateDevice(cookie.cookie);
+    else if (cookie.evtype == XI_HierarchyChanged)
+        updateDevices(activeCore().currentWindow());
+}
+
+void KeyboardDaemon::updateDevices(Window activeWindow)
 {
-    if (m_ignoreNextGroupSave) {
-        m_ignoreNextGroupSave = false;
+    int count;
+    const std::unique_ptr<XIDeviceInfo[], Deleter<XIFreeDeviceInfo>> devices(XIQueryDevice(m_display.get(), XIAllDevices, &count));
+    if (!devices)
+        throw std::logic_error("Unable to query input devices");
+
+    std::vector<bool> present(m_devices.size());
+    for (int i = 0; i < count; ++i) {
+        if (devices[i].use != XISlaveKeyboard || !devices[i].enabled)
+            continue;
+
+        const auto id = static_cast<unsigned>(devices[i].deviceid);
+        if (id >= m_devices.size()) {
+            m_devices.resize(id + 1);
+            present.resize(id + 1);
+        }
+        present[id] = true;
+        if (m_devices[id])
+            continue;
+
+        XkbStateRec state;
+        countReply();
+        if (XkbGetState(m_display.get(), id, &state) != Success)
+            throw std::logic_error("Unable to get state of keyboard " + std::string(devices[i].name));
+        XkbSelectEventDetails(m_display.get(), id, XkbStateNotify, XkbAllStateComponentsMask, XkbGroupStateMask);
+
+        std::unique_ptr<Device> &device = m_devices[id];
+        device = std::make_unique<Device>(*this, id);
+        if (m_activeDevice >= m_devices.size() || !m_devices[m_activeDevice])
+            m_activeDevice = id;
+        if (m_trace)
+            device->core.setTrace(&m_trace.value());
+        device->core.configure(coreSettings(m_parameters.value()));
+        device->core.setLayouts(groupsCounts());
+        device->core.initialize(activeWindow, state.group);
+    }
+
+    if (std::find(present.cbegin(), present.cend(), true) == present.cend()) {
+        if (m_devices.empty())
+            throw std::logic_error("Unable to find keyboard devices");
+        // Keep the state until a keyboard is attached again
         return;
     }
 
-    m_currentWindow->second.group = event.group;
+    for (size_t id = 0; id < m_devices.size(); ++id) {
+        if (!present[id])
+            m_devices[id].reset();
+    }
+    if (!m_devices[m_activeDevice])
+        m_activeDevice = static_cast<unsigned>(std::find(present.cbegin(), present.cend(), true) - present.cbegin());
+}
+
+void KeyboardDaemon::activateDevice(unsigned id)
+{
+    if (id == m_activeDevice || id >= m_devices.size() || !m_devices[id])
+        return;
+
+    m_activeDevice = id;
+    if (const uint16_t appliedLayoutIndex = activeCore().appliedLayoutIndex(); appliedLayoutIndex < m_layouts.size())
+        m_shortcuts.switchLayout(m_layouts[appliedLayoutIndex], appliedLayoutIndex);
     printCurrentGroup();
 }
+#endif
 
-void KeyboardDaemon::setLayout(size_t layoutIndex)
+KeyboardCore &KeyboardDaemon::activeCore()
 {
-    m_layouts[layoutIndex].apply();
+    if (m_perDevice)
+        return m_devices[m_activeDevice]->core;
+    return m_core;
 }
 
-void KeyboardDaemon::setGroup(unsigned char group)
+const KeyboardCore &KeyboardDaemon::activeCore() const
 {
-    if (!XkbLockGroup(m_display.get(), XkbUseCoreKbd, group))
-        throw std::logic_error("Unable to switch group to " + std::to_string(group));
+    if (m_perDevice)
+        return m_devices[m_activeDevice]->core;
+    return m_core;
+}
+
+template<typename Function>
+void KeyboardDaemon::forEachCore(Function function)
+{
+    if (!m_perDevice) {
+        function(m_core);
+        return;
+    }
+
+    for (const std::unique_ptr<Device> &device : m_devices) {
+        if (device)
+            function(device->core);
+    }
+}
+
+void KeyboardDaemon::skipSupersededFocusChanges(std::vector<XkbEvent> &events)
+{
+    // Active window change is superseded if it's followed by another one without
+    // events that depend on the current window in between, like shortcuts or group changes
+    bool superseded = false;
+    for (auto it = events.rbegin(); it != events.rend(); ++it) {
+        if (it->type == PropertyNotify && it->core.xproperty.atom == m_activeWindowProperty && it->core.xproperty.state == PropertyNewValue) {
+            if (superseded) {
+                // Event with a different atom will be ignored by the handler
+                it->core.xproperty.atom = None;
+                ++m_skippedFocusChanges;
+                if (m_trace)
+                    m_trace->instant(TraceRing::Event::SkippedFocusChange);
+            }
+            superseded = true;
+        } else if (it->type == KeyPress || it->type == m_xkbEventType) {
+            superseded = false;
+        }
+    }
+}
+
+std::optional<std::chrono::steady_clock::time_point> KeyboardDaemon::nextDeadline()
+{
+    std::optional<std::chrono::steady_clock::time_point> deadline = m_reconcileTime;
+    forEachCore([&deadline](KeyboardCore &core) {
+        if (core.hasPendingChanges() && (!deadline || core.commitTime() < deadline.value()))
+            deadline = core.commitTime();
+    });
+    return deadline;
+}
 
-    // This will produce XkbStateNotifyEvent event, ignore it
-    m_ignoreNextGroupSave = true;
+void KeyboardDaemon::trackWindow(Window window)
+{
+    if (window == m_root)
+        return;
+
+    // Destroy events are delivered directly, even if the window was reparented
+    XSelectInput(m_display.get(), window, StructureNotifyMask);
+
+    // Reconcile only after new windows appear, so there are no wakeups while idle
+    if (!m_reconcileTime)
+        m_reconcileTime = std::chrono::steady_clock::now() + reconcileInterval;
+}
+
+void KeyboardDaemon::reconcileWindows()
+{
+    m_reconcileTime.reset();
+
+    std::vector<Window> clients = PropertyRequest(*m_display, m_root, m_clientListProperty, clientListLength).windowsReply();
+
+    // Window manager doesn't support the client list
+    if (clients.empty())
+        return;
+
+    std::sort(clients.begin(), clients.end());
+    std::vector<Window> removedWindows;
+    forEachCore([this, &clients, &removedWindows](KeyboardCore &core) {
+        for (const Window window : core.windows()) {
+            // Current window state is needed until the next window is activated
+            if (window == m_root || window == core.currentWindow() || std::binary_search(clients.cbegin(), clients.cend(), window))
+                continue;
+
+            core.destroyWindow(window);
+            removedWindows.push_back(window);
+        }
+    });
+
+    // Devices usually track the same windows, each window is counted once
+    std::sort(removedWindows.begin(), removedWindows.end());
+    const auto removed = static_cast<size_t>(std::unique(removedWindows.begin(), removedWindows.end()) - removedWindows.begin());
+
+    if (removed != 0) {
+        m_staleWindowsRemoved += removed;
+        std::cerr << "Removed " << removed << " stale windows (" << m_staleWindowsRemoved << " total)" << std::endl;
+    }
 }
 
 void KeyboardDaemon::loadParameters(const Parameters &parameters)
 {
-    m_defaultGroup = parameters.defaultGroup();
-    m_useDifferentGroups = parameters.isUseDifferentGroups();
-    m_useDifferentLayouts = parameters.useDifferentLayouts();
-    m_printGroups = parameters.isPrintGroups();
+    if (parameters.isPrintGroups())
+        m_output.emplace(STDOUT_FILENO);
+    // Each display of a shared process is served at its default path
+    if (const std::optional<std::filesystem::path> socketPath = parameters.socketPath(); socketPath)
+        m_server.emplace(m_displayName.empty() ? socketPath.value() : Server::defaultPath(m_displayName.c_str()));
+    if (std::optional<std::filesystem::path> traceFile = parameters.traceFile(); traceFile) {
+        m_trace.emplace(traceCapacity);
+        m_traceFile = std::move(traceFile.value());
+        if (!m_displayName.empty())
+            m_traceFile += '.' + m_displayName;
+        m_core.setTrace(&m_trace.value());
+    }
+    if (const std::optional<std::filesystem::path> recordFile = parameters.recordFile(); recordFile) {
+        // Replay drives a single keyboard
+        if (parameters.isPerDevice())
+            throw std::logic_error("Events can't be recorded for each device separately");
+        m_recorder.emplace(recordFile.value());
+        m_core.setRecorder(&m_recorder.value());
+    }
+    m_core.configure(coreSettings(parameters));
 
-    const KeyboardSymbols symbols = KeyboardSymbols::currentSymbols(*m_display);
-    if (std::optional<std::vector<std::string>> layouts = parameters.layouts(); layouts) {
-        for (std::string &layout : layouts.value())
-            m_layouts.emplace_back(*m_display, std::move(layout), symbols.options);
+    // Server symbols are read only once, later they will be replaced by applied layouts
+    KeyboardSymbols symbols = KeyboardSymbols::currentSymbols(*m_display);
+    m_serverGroups = boost::join(symbols.groups, ",");
+    m_serverOptions = std::move(symbols.options);
+    openStateFile(parameters);
+
+    m_layouts = createLayouts(parameters);
+    if (parameters.layouts()) {
         if (!parameters.isSkipRules())
             Layout::saveKeyboardRules(*m_display);
-        setLayout(0);
-    } else {
-        m_layouts.emplace_back(*m_display, boost::join(symbols.groups, ","));
+
+        // Server could already use the first layout, e.g. after the daemon restart, other layouts are compiled on the first use
+        if (m_layouts.front().layoutString() != m_serverGroups)
+            m_layouts.front().apply();
+    }
+    m_fullGroupNames = parameters.isFullGroupNames();
+    if (m_fullGroupNames) {
+        for (Layout &layout : m_layouts)
+            layout.loadFullGroupNames();
     }
 
-    if (const std::optional<std::string> nextLayout = parameters.nextLayoutShortcut(); nextLayout)
-        m_shortcuts.emplace_back(nextLayout.value(), *this, &KeyboardDaemon::switchToNextLayout);
+    m_core.setLayouts(groupsCounts());
+    loadWindowRules(WindowRules(parameters.windowClassRules(), parameters.windowRoleRules(), parameters.windowTitleRules(), m_layouts.size()));
+
+    m_shortcuts = createShortcuts(parameters, m_layouts.size());
+    if (!m_shortcuts.empty()) {
+        m_shortcuts.computeKeycodes(m_layouts[m_core.appliedLayoutIndex()], m_core.appliedLayoutIndex());
+        if (const std::vector<std::string> failedShortcuts = m_shortcuts.grab(*m_display, m_root, m_core.appliedLayoutIndex()); !failedShortcuts.empty())
+            throw std::logic_error("Shortcut is already grabbed by another application: " + failedShortcuts.front());
+    }
+
+#ifdef WITH_XINPUT
+    if (parameters.isPerDevice()) {
+        selectDeviceEvents();
+        m_perDevice = true;
+    }
+#endif
+    diffLayouts();
+
+    // Layouts without symbols use the server keymap, so there is nothing to prepare
+    if (parameters.isPrepareKeymaps() && parameters.layouts()) {
+        m_keymapWorker.emplace(m_displayName.empty() ? nullptr : m_displayName.c_str());
+        prepareKeymaps(m_core.appliedLayoutIndex());
+    }
+
+    // Directory could be created later, but watching for it is not worth it
+    m_parameters.emplace(parameters);
+    if (const std::filesystem::path settingsPath = parameters.settingsPath(); !settingsPath.empty() && std::filesystem::is_directory(settingsPath.parent_path()))
+        m_settingsWatcher.emplace(settingsPath);
 }
 
-void KeyboardDaemon::saveCurrentGroup()
+void KeyboardDaemon::reloadParameters()
 {
-    const unsigned char group = currentGroup();
+    const auto startTime = std::chrono::steady_clock::now();
+    const Parameters parameters = m_parameters->reload();
 
-    m_currentWindow->second.group = group;
+    // Prepare everything that could fail before changing the state, unchanged layouts are reused to keep compiled keymaps
+    std::vector<Layout> createdLayouts = createLayouts(parameters);
+    std::vector<std::optional<size_t>> reusedIndices(createdLayouts.size());
+    std::vector<bool> reused(m_layouts.size());
+    std::vector<Layout *> layouts;
+    const uint16_t oldLayoutIndex = activeCore().currentKeyboard().layoutIndex;
+    size_t currentLayoutIndex = 0;
+    for (size_t i = 0; i < createdLayouts.size(); ++i) {
+        for (size_t j = 0; j < m_layouts.size(); ++j) {
+            if (!reused[j] && m_layouts[j].hasSameSymbols(createdLayouts[i])) {
+                reused[j] = true;
+                reusedIndices[i] = j;
+                if (j == oldLayoutIndex)
+                    currentLayoutIndex = i;
+                break;
+            }
+        }
+
+        if (reusedIndices[i]) {
+            layouts.push_back(&m_layouts[reusedIndices[i].value()]);
+        } else {
+            // Invalid layouts are reported now instead of on the first switch to them
+            if (createdLayouts[i].needsCompile())
+                createdLayouts[i].compile();
+            if (m_fullGroupNames)
+                createdLayouts[i].loadFullGroupNames();
+            layouts.push_back(&createdLayouts[i]);
+        }
+    }
+
+    WindowRules windowRules(parameters.windowClassRules(), parameters.windowRoleRules(), parameters.windowTitleRules(), createdLayouts.size());
+    ShortcutTable shortcuts = createShortcuts(parameters, createdLayouts.size());
+    // Keycodes of other layouts will be computed on the first switch to them
+    shortcuts.computeKeycodes(*layouts[currentLayoutIndex], currentLayoutIndex);
+
+    // Keymap of the applied layout could belong to another layout with the new order
+    const uint16_t appliedLayoutIndex = m_core.appliedLayoutIndex();
+    const std::string uploadedKeymap = appliedLayoutIndex < m_keymaps.size() ? m_layouts[m_keymaps[appliedLayoutIndex].layoutIndex].layoutString() : std::string();
+
+    // Shortcuts and rules refer to layout indices, so they are replaced together with layouts.
+    // Only keys that differ are grabbed again. Too late to refuse the settings, so only shortcuts grabbed by other applications are disabled.
+    for (const std::string &shortcut : shortcuts.grab(*m_display, m_root, currentLayoutIndex, &m_shortcuts))
+        std::cerr << "Shortcut is already grabbed by another application and will be disabled: " << shortcut << std::endl;
+    m_shortcuts = std::move(shortcuts);
+    loadWindowRules(std::move(windowRules));
+
+    // Remap layout indices, windows with removed layouts use the first one
+    std::vector<uint16_t> newIndices(m_layouts.size(), KeyboardCore::removedLayout);
+    std::vector<Layout> newLayouts;
+    newLayouts.reserve(createdLayouts.size());
+    for (size_t i = 0; i < createdLayouts.size(); ++i) {
+        if (reusedIndices[i]) {
+            newIndices[reusedIndices[i].value()] = static_cast<uint16_t>(i);
+            newLayouts.push_back(std::move(m_layouts[reusedIndices[i].value()]));
+        } else {
+            newLayouts.push_back(std::move(createdLayouts[i]));
+        }
+    }
+
+    m_layouts = std::move(newLayouts);
+    forEachCore([this, &newIndices](KeyboardCore &core) {
+        core.setLayouts(groupsCounts(), newIndices);
+    });
+    diffLayouts();
+    if (const uint16_t newAppliedLayoutIndex = m_core.appliedLayoutIndex(); !m_perDevice && newAppliedLayoutIndex < m_layouts.size()) {
+        if (Layout &keymap = m_layouts[m_keymaps[newAppliedLayoutIndex].layoutIndex]; keymap.layoutString() != uploadedKeymap) {
+            keymap.apply();
+            lockGroup(m_core.appliedGroup());
+        }
+    }
+
+    if (parameters.layouts() && !parameters.isSkipRules() && !Layout::hasKeyboardRules(*m_display))
+        Layout::saveKeyboardRules(*m_display);
+
+    const KeyboardCore::Settings settings = coreSettings(parameters);
+    const bool windowEventsChanged = settings.useDifferentGroups != activeCore().settings().useDifferentGroups || settings.useDifferentLayouts != activeCore().settings().useDifferentLayouts;
+    forEachCore([&settings](KeyboardCore &core) {
+        core.configure(settings);
+    });
+    if (windowEventsChanged)
+        selectWindowEvents();
+
+    if (parameters.stateFile() != m_parameters->stateFile() || layoutsHash(parameters) != layoutsHash(m_parameters.value())) {
+        m_stateFile.reset();
+        openStateFile(parameters);
+    }
+
+    prepareKeymaps(activeCore().appliedLayoutIndex());
+    m_parameters.emplace(parameters);
     printCurrentGroup();
+
+    const auto elapsedTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime);
+    std::cerr << "Settings reloaded in " << elapsedTime.count() / 1000.0 << " ms" << std::endl;
+}
+
+KeyboardCore::Settings KeyboardDaemon::coreSettings(const Parameters &parameters)
+{
+    KeyboardCore::Settings settings;
+    settings.defaultGroup = parameters.defaultGroup();
+    settings.commitDelay = parameters.commitDelay();
+    settings.maxWindows = parameters.maxWindows();
+    settings.useDifferentGroups = parameters.isUseDifferentGroups();
+    settings.useDifferentLayouts = parameters.useDifferentLayouts();
+    return settings;
+}
+
+std::vector<unsigned char> KeyboardDaemon::groupsCounts() const
+{
+    std::vector<unsigned char> counts;
+    counts.reserve(m_layouts.size());
+    for (const Layout &layout : m_layouts)
+        counts.push_back(layout.groupsCount());
+    return counts;
+}
+
+void KeyboardDaemon::diffLayouts()
+{
+    m_keymaps.clear();
+    m_keymaps.reserve(m_layouts.size());
+    for (size_t i = 0; i < m_layouts.size(); ++i) {
+        LayoutKeymap keymap{i, {}};
+        // Each device has its own keymap, so the uploaded one isn't known
+        if (!m_perDevice) {
+            for (size_t j = 0; j < i; ++j) {
+                if (m_keymaps[j].layoutIndex != j)
+                    continue;
+                if (std::optional<std::vector<unsigned char>> groups = m_layouts[i].groupsIn(m_layouts[j]); groups) {
+                    keymap = {j, std::move(groups.value())};
+                    break;
+                }
+            }
+        }
+        m_keymaps.push_back(std::move(keymap));
+    }
 }
 
-void KeyboardDaemon::printCurrentGroup() const
+unsigned char KeyboardDaemon::keymapGroup(size_t layoutIndex, unsigned char group) const
 {
-    if (!m_printGroups)
+    if (layoutIndex >= m_keymaps.size() || m_keymaps[layoutIndex].groups.empty())
+        return group;
+
+    // XKB wraps group indices that exceed the number of groups
+    const std::vector<unsigned char> &groups = m_keymaps[layoutIndex].groups;
+    return groups[group % groups.size()];
+}
+
+unsigned char KeyboardDaemon::layoutGroup(size_t layoutIndex, unsigned char keymapGroup) const
+{
+    if (layoutIndex >= m_keymaps.size())
+        return keymapGroup;
+
+    const std::vector<unsigned char> &groups = m_keymaps[layoutIndex].groups;
+    const auto it = std::find(groups.cbegin(), groups.cend(), keymapGroup);
+    if (it == groups.cend())
+        return keymapGroup;
+    return static_cast<unsigned char>(it - groups.cbegin());
+}
+
+void KeyboardDaemon::prepareKeymaps(size_t layoutIndex)
+{
+    if (!m_keymapWorker)
         return;
 
-    std::cout << m_layouts[m_currentWindow->second.layoutIndex].groupName(m_currentWindow->second.group) << std::endl;
+    // Shortcuts switch to the next or previous layout, used layouts keep their keymaps
+    for (const size_t index : {(layoutIndex + 1) % m_layouts.size(), (layoutIndex + m_layouts.size() - 1) % m_layouts.size()}) {
+        if (const Layout &keymap = m_layouts[m_keymaps[index].layoutIndex]; keymap.needsCompile())
+            m_keymapWorker->prepare(keymap.symbols());
+    }
+}
+
+void KeyboardDaemon::takePreparedKeymaps()
+{
+    // Layout could be compiled on use or removed on reload before its keymap is ready
+    for (KeymapWorker::Keymap &keymap : m_keymapWorker->takeKeymaps()) {
+        if (!keymap.desc)
+            continue;
+        const auto it = std::find_if(m_layouts.begin(), m_layouts.end(), [&keymap](const Layout &layout) {
+            return layout.needsCompile() && layout.symbols() == keymap.symbols;
+        });
+        if (it != m_layouts.end())
+            it->setKeymap(std::move(keymap.desc));
+    }
+}
+
+std::vector<Layout> KeyboardDaemon::createLayouts(const Parameters &parameters) const
+{
+    std::vector<Layout> layouts;
+    if (std::optional<std::vector<std::string>> layoutStrings = parameters.layouts(); layoutStrings) {
+        for (std::string &layout : layoutStrings.value())
+            layouts.emplace_back(*m_display, std::move(layout), m_serverOptions);
+    } else {
+        layouts.emplace_back(*m_display, m_serverGroups);
+    }
+
+    if (layouts.size() > std::numeric_limits<decltype(Keyboard::layoutIndex)>::max())
+        throw std::logic_error("Too many layouts specified");
+
+    return layouts;
 }
 
-void KeyboardDaemon::printGroupFromKeyboardRules(unsigned char group) const
+ShortcutTable KeyboardDaemon::createShortcuts(const Parameters &parameters, size_t layoutsCount)
 {
-    std::unique_ptr<XkbRF_VarDefsRec, VarDefsDeleter> currentVarDefs(new XkbRF_VarDefsRec);
-    if (!XkbRF_GetNamesProp(m_display.get(), nullptr, currentVarDefs.get()))
+    ShortcutTable shortcuts;
+    if (const std::optional<std::string> nextLayout = parameters.nextLayoutShortcut(); nextLayout)
+        shortcuts.add(nextLayout.value(), {ShortcutTable::Action::NextLayout});
+    if (const std::optional<std::string> previousLayout = parameters.previousLayoutShortcut(); previousLayout)
+        shortcuts.add(previousLayout.value(), {ShortcutTable::Action::PreviousLayout});
+    if (const std::optional<std::string> lastLayout = parameters.lastLayoutShortcut(); lastLayout)
+        shortcuts.add(lastLayout.value(), {ShortcutTable::Action::LastLayout});
+    for (const std::string &shortcut : parameters.setLayoutShortcuts())
+        shortcuts.addIndexed(shortcut, ShortcutTable::Action::SetLayout, layoutsCount);
+    for (const std::string &shortcut : parameters.setGroupShortcuts())
+        shortcuts.addIndexed(shortcut, ShortcutTable::Action::SetGroup, XkbNumKbdGroups);
+    return shortcuts;
+}
+
+void KeyboardDaemon::loadWindowRules(WindowRules windowRules)
+{
+    m_windowRules = std::move(windowRules);
+    if (m_windowRules.hasRoleRules() && m_windowRoleProperty == None)
+        m_windowRoleProperty = AtomRequest(*m_display, "WM_WINDOW_ROLE").reply();
+    if (m_windowRules.hasTitleRules() && m_windowNameProperty == None)
+        m_windowNameProperty = AtomRequest(*m_display, "_NET_WM_NAME").reply();
+}
+
+void KeyboardDaemon::openStateFile(const Parameters &parameters)
+{
+    std::optional<std::filesystem::path> stateFile = parameters.stateFile();
+    if (!stateFile)
+        return;
+
+    // Window ids and server layouts are per display, so each display keeps its own file
+    if (!m_displayName.empty())
+        stateFile.value() += '.' + m_displayName;
+    m_stateFile.emplace(stateFile.value(), layoutsHash(parameters));
+}
+
+uint32_t KeyboardDaemon::layoutsHash(const Parameters &parameters) const
+{
+    // Saved layout indices are valid only for the same layouts
+    const std::optional<std::vector<std::string>> layouts = parameters.layouts();
+    return StateFile::hash(layouts ? boost::join(layouts.value(), " ") : m_serverGroups);
+}
+
+void KeyboardDaemon::selectWindowEvents()
+{
+    if (activeCore().settings().useDifferentGroups || activeCore().settings().useDifferentLayouts) {
+        XSelectInput(m_display.get(), m_root, PropertyChangeMask); // Listen for current window change events
+        trackWindow(activeCore().currentWindow());
+    } else {
+        XSelectInput(m_display.get(), m_root, NoEventMask);
+    }
+}
+
+void KeyboardDaemon::printCurrentGroup()
+{
+    const Keyboard currentKeyboard = activeCore().currentKeyboard();
+    printGroupIfDifferent(currentKeyboard.group, currentKeyboard.layoutIndex);
+}
+
+void KeyboardDaemon::printGroupFromKeyboardRules() const
+{
+    // Send all requests at once to wait for replies only once
+    GroupRequest groupRequest(*m_display);
+    AtomRequest rulesAtomRequest(*m_display, _XKB_RF_NAMES_PROP_ATOM);
+    PropertyRequest rulesRequest(*m_display, XDefaultRootWindow(m_display.get()), rulesAtomRequest.reply(), _XKB_RF_NAMES_PROP_MAXLEN);
+
+    // Property contains null-separated rules file, model, layout, variant and options
+    const std::string rules = rulesRequest.stringReply();
+    const size_t modelEnd = rules.find('\0', rules.find('\0') + 1);
+    if (modelEnd == std::string::npos)
         throw std::logic_error("Unable to get keyboard rules");
 
-    boost::tokenizer layoutTokenizer(std::string_view(currentVarDefs->layout), boost::char_separator(","));
+    const std::string_view layout(rules.data() + modelEnd + 1);
+    boost::tokenizer layoutTokenizer(layout, boost::char_separator(","));
     auto currentGroupName = layoutTokenizer.begin();
-    std::advance(currentGroupName, group);
+    std::advance(currentGroupName, groupRequest.reply());
 
     std::cout << currentGroupName.current_token() << '\n';
 }
 
-void KeyboardDaemon::printGroupIfDifferent(unsigned char newGroup, size_t newLayoutIndex) const
+void KeyboardDaemon::printGroupIfDifferent(unsigned char newGroup, size_t newLayoutIndex)
 {
-    if (!m_printGroups)
+    if (!m_output && !m_server)
+        return;
+
+    // Different groups and layouts could have the same name
+    const Layout &layout = m_layouts[newLayoutIndex];
+    const uint16_t groupNameId = layout.groupNameId(newGroup);
+    if (groupNameId == m_printedGroupNameId)
         return;
 
-    // Compare groups lexically to check if groups different
-    const std::string_view newGroupName = m_layouts[newLayoutIndex].groupName(newGroup);
-    const std::string_view currentGroupName = m_layouts[m_currentWindow->second.layoutIndex].groupName(m_currentWindow->second.group);
-    if (newGroupName != currentGroupName)
-        std::cout << newGroupName << std::endl;
+    m_printedGroupNameId = groupNameId;
+    const std::string_view groupName = layout.groupName(newGroup);
+    if (m_output)
+        m_output->writeLine(groupName);
+    if (m_server)
+        m_server->publish(groupName);
 }
 
-Window KeyboardDaemon::activeWindow() const
+std::optional<uint32_t> KeyboardDaemon::loadInitialState(Window window, Keyboard &keyboard)
 {
-    Atom type;
-    int format;
-    unsigned long size;
-    unsigned long remainSize;
-    unsigned char *bytes;
+    // Send all requests at once
+    PropertyRequest classRequest(*m_display, window, XA_WM_CLASS, windowPropertyLength);
+    std::optional<PropertyRequest> roleRequest;
+    if (m_windowRules.hasRoleRules())
+        roleRequest.emplace(*m_display, window, m_windowRoleProperty, windowPropertyLength);
+    std::optional<PropertyRequest> titleRequest;
+    std::optional<PropertyRequest> legacyTitleRequest;
+    if (m_windowRules.hasTitleRules()) {
+        titleRequest.emplace(*m_display, window, m_windowNameProperty, windowPropertyLength);
+        legacyTitleRequest.emplace(*m_display, window, XA_WM_NAME, windowPropertyLength);
+    }
 
-    const int result = XGetWindowProperty(m_display.get(), m_root, m_activeWindowProperty, 0, 1, false, AnyPropertyType,
-                                          &type, &format, &size, &remainSize, &bytes);
+    const std::string windowClass = classRequest.stringReply();
+    const std::string role = roleRequest ? roleRequest->stringReply() : std::string();
+    std::string title = titleRequest ? titleRequest->stringReply() : std::string();
+    if (legacyTitleRequest) {
+        std::string legacyTitle = legacyTitleRequest->stringReply();
+        if (title.empty())
+            title = std::move(legacyTitle);
+    }
 
-    if (result != Success)
-        throw std::logic_error("Unable to get active window property");
+    // Remembered window state has the highest priority, then rules and remembered class state
+    std::optional<uint32_t> classHash;
+    if (m_stateFile) {
+        classHash = StateFile::hash(windowClass);
+        if (const std::optional<Keyboard> windowState = m_stateFile->windowState(window, classHash.value()); windowState && windowState->layoutIndex < m_layouts.size()) {
+            keyboard = windowState.value();
+            return classHash;
+        }
+    }
 
-    // There is no active window
-    if (type == None)
-        return m_root;
+    if (const std::optional<WindowRules::Target> target = m_windowRules.match(windowClass, role, title); target) {
+        keyboard.group = target->group;
+        if (target->layoutIndex)
+            keyboard.layoutIndex = target->layoutIndex.value();
+        return classHash;
+    }
 
-    Window window = *reinterpret_cast<Window *>(bytes);
-    XFree(bytes);
+    if (classHash) {
+        if (const std::optional<Keyboard> classState = m_stateFile->classState(classHash.value()); classState && classState->layoutIndex < m_layouts.size())
+            keyboard = classState.value();
+    }
+
+    return classHash;
+}
+
+Window KeyboardDaemon::activeWindow(PropertyRequest request) const
+{
+    const std::vector<Window> windows = request.windowsReply();
+
+    // There is no active window, EWMH also allows None
+    if (windows.empty() || windows.front() == None)
+        return m_root;
 
-    return window;
+    return windows.front();
 }
 
 unsigned char KeyboardDaemon::currentGroup() const
 {
-    XkbStateRec state;
-    XkbGetState(m_display.get(), XkbUseCoreKbd, &state);
-    return state.group;
+    return GroupRequest(*m_display).reply();
 }
@@ -20,68 +20,215 @@
 #ifndef KEYBOARDDAEMON_H
 #define KEYBOARDDAEMON_H
 
+#include "cmake.h"
 #include "keyboard.h"
+#include "eventloop.h"
+#include "eventrecorder.h"
+#include "keyboardcore.h"
+#include "keymapworker.h"
 #include "layout.h"
+#include "outputsink.h"
+#include "parameters.h"
+#include "server.h"
+#include "settingswatcher.h"
 #include "shortcut.h"
+#include "statefile.h"
+#include "statistics.h"
+#include "tracering.h"
+#include "windowrules.h"
 #include "x11deleters.h"
 
+#include <chrono>
 #include <memory>
-#include <unordered_map>
 
 #include <X11/XKBlib.h>
 
 class KeyboardSymbols;
-class Parameters;
+class PropertyRequest;
 
-class KeyboardDaemon
+class KeyboardDaemon : private KeyboardCore::Backend
 {
 public:
-    explicit KeyboardDaemon(const Parameters &parameters);
+    // Event loop ids used by a single daemon
+    static constexpr uint32_t sourcesCount = 5;
+
+    // Connects to the specified display or to $DISPLAY. Daemons that serve several displays from one process
+    // share the event loop and register their descriptors with ids starting from sourcesBase.
+    explicit KeyboardDaemon(const Parameters &parameters, const char *displayName = nullptr, EventLoop *sharedEventLoop = nullptr, uint32_t sourcesBase = 0);
+    KeyboardDaemon(const KeyboardDaemon &) = delete;
+    KeyboardDaemon &operator=(const KeyboardDaemon &) = delete;
+    ~KeyboardDaemon() override;
 
     [[nodiscard]] bool needProcessEvents() const;
-    [[noreturn]] void processEvents();
+    // Returns after termination signal
+    void processEvents();
+
+    // Steps of processEvents for a shared event loop
+    [[nodiscard]] bool hasQueuedEvents() const;
+    // Handles ready sources, specified without sourcesBase, then queued X events and expired deadlines
+    void processBatch(const std::vector<uint32_t> &sources);
+    [[nodiscard]] std::optional<std::chrono::steady_clock::time_point> nextDeadline();
+    void printStatistics() const;
+    void saveTrace() const;
+    // With a shared event loop the lost connection doesn't exit the process, the daemon should be destroyed instead
+    [[nodiscard]] bool isConnected() const;
 
     [[nodiscard]] Display &display() const;
     [[nodiscard]] Window root() const;
 
-    void switchToNextLayout();
-
 private:
     // Event handlers
     void applyWindowLayout(const XPropertyEvent &event);
     void removeDestroyedWindow(const XDestroyWindowEvent &event);
     void processShortcuts(const XKeyEvent &event);
+    void updateKeyboardMapping(XMappingEvent &event);
+    void processRequests();
+    [[nodiscard]] Statistics::Counters statisticsCounters() const;
     void saveCurrentGroup(const XkbStateNotifyEvent &event);
+    static void setDisconnected(Display *display, void *daemon);
+
+    // KeyboardCore backend
+    void windowCreated(Window window, Keyboard &keyboard) override;
+    void windowChanged(Window window, Keyboard keyboard) override;
+    void windowDestroyed(Window window) override;
+    void groupChanged(size_t layoutIndex, unsigned char group) override;
+    void applyLayout(size_t layoutIndex) override;
+    void lockGroup(unsigned char group) override;
+    // The applied layout of the calling core is the current keymap of the device
+    void applyLayout(size_t layoutIndex, unsigned deviceSpec, const KeyboardCore &core);
+    void lockGroup(unsigned char group, unsigned deviceSpec, const KeyboardCore &core);
+
+    // Keyboard state of a slave keyboard with general.per-device, only the last used device reports window changes
+    class DeviceBackend : public KeyboardCore::Backend
+    {
+    public:
+        DeviceBackend(KeyboardDaemon &daemon, unsigned id);
+
+        void windowCreated(Window window, Keyboard &keyboard) override;
+        void windowChanged(Window window, Keyboard keyboard) override;
+        void windowDestroyed(Window window) override;
+        void groupChanged(size_t layoutIndex, unsigned char group) override;
+        void applyLayout(size_t layoutIndex) override;
+        void lockGroup(unsigned char group) override;
+
+    private:
+        [[nodiscard]] bool isActive() const;
+        [[nodiscard]] const KeyboardCore &core() const;
+
+        KeyboardDaemon &m_daemon;
+        unsigned m_id;
+    };
+
+    struct Device {
+        Device(KeyboardDaemon &daemon, unsigned id);
+
+        DeviceBackend backend;
+        KeyboardCore core;
+    };
+
+    // Core of the last used device with general.per-device
+    [[nodiscard]] KeyboardCore &activeCore();
+    [[nodiscard]] const KeyboardCore &activeCore() const;
+    template<typename Function>
+    void forEachCore(Function function);
+
+#ifdef WITH_XINPUT
+    void selectDeviceEvents();
+    // Replaces the cookie with the event type and the source device, 0 type means the event is ignored
+    void readDeviceEvent(XGenericEventCookie &cookie);
+    void processDeviceEvent(const XGenericEventCookie &cookie);
+    void updateDevices(Window activeWindow);
+    void activateDevice(unsigned id);
+#endif
 
     // Helpers
-    void setLayout(size_t layoutIndex);
-    void setGroup(unsigned char group);
+    void skipSupersededFocusChanges(std::vector<XkbEvent> &events);
 
-    void loadParameters(const Parameters &parameters);
-    void saveCurrentGroup();
+    void trackWindow(Window window);
+    void reconcileWindows();
 
-    void printCurrentGroup() const;
-    void printGroupFromKeyboardRules(unsigned char group) const;
-    void printGroupIfDifferent(unsigned char newGroup, size_t newLayoutIndex) const;
-    [[nodiscard]] Window activeWindow() const;
+    void loadParameters(const Parameters &parameters);
+    void reloadParameters();
+    [[nodiscard]] static KeyboardCore::Settings coreSettings(const Parameters &parameters);
+    [[nodiscard]] std::vector<unsigned char> groupsCounts() const;
+    [[nodiscard]] std::vector<Layout> createLayouts(const Parameters &parameters) const;
+    void diffLayouts();
+    [[nodiscard]] unsigned char keymapGroup(size_t layoutIndex, unsigned char group) const;
+    [[nodiscard]] unsigned char layoutGroup(size_t layoutIndex, unsigned char keymapGroup) const;
+    void prepareKeymaps(size_t layoutIndex);
+    void takePreparedKeymaps();
+    [[nodiscard]] static ShortcutTable createShortcuts(const Parameters &parameters, size_t layoutsCount);
+    void loadWindowRules(WindowRules windowRules);
+    void openStateFile(const Parameters &parameters);
+    [[nodiscard]] uint32_t layoutsHash(const Parameters &parameters) const;
+    void selectWindowEvents();
+
+    void printCurrentGroup();
+    void printGroupFromKeyboardRules() const;
+    void printGroupIfDifferent(unsigned char newGroup, size_t newLayoutIndex);
+    // Returns window class hash if the state file is used
+    [[nodiscard]] std::optional<uint32_t> loadInitialState(Window window, Keyboard &keyboard);
+    [[nodiscard]] Window activeWindow(PropertyRequest request) const;
     [[nodiscard]] unsigned char currentGroup() const;
 
-    const std::unique_ptr<Display, DisplayDeleter> m_display{XkbOpenDisplay(nullptr, &m_xkbEventType, nullptr, nullptr, nullptr, nullptr)};
+    bool m_disconnected = false; // Set by Xlib, so it's declared before the display to outlive closing it
+    const std::unique_ptr<Display, DisplayDeleter> m_display;
+    const std::string m_displayName; // Empty for $DISPLAY
     Window m_root;
     Atom m_activeWindowProperty;
+    Atom m_clientListProperty;
+    Atom m_windowRoleProperty = None;
+    Atom m_windowNameProperty = None;
     int m_xkbEventType;
 
-    std::unordered_map<Window, Keyboard> m_windows;
+    KeyboardCore m_core{*this};
     std::vector<Layout> m_layouts;
-    std::vector<Shortcut> m_shortcuts;
 
-    decltype(m_windows)::iterator m_currentWindow;
-    std::optional<unsigned char> m_defaultGroup;
-    bool m_ignoreNextGroupSave = false;
+    // Layouts with the same groups in another order use the keymap of the first such layout, switching between them only locks the group
+    struct LayoutKeymap {
+        size_t layoutIndex;
+        std::vector<unsigned char> groups; // Keymap group for each group of the layout, empty if the layout uses its own keymap
+    };
+    std::vector<LayoutKeymap> m_keymaps; // Indexed by layout
+    std::optional<KeymapWorker> m_keymapWorker;
+    std::string m_serverGroups;
+    std::vector<std::string> m_serverOptions;
+    ShortcutTable m_shortcuts;
+    std::optional<StateFile> m_stateFile;
+    WindowRules m_windowRules;
+
+    // Class hash of the window created last, saved with its state once the state is known
+    std::optional<std::pair<Window, uint32_t>> m_createdWindowClass;
+    // Devices create the same window one after another, so its initial state is loaded once
+    std::optional<std::pair<Window, Keyboard>> m_createdWindowState;
+    std::vector<std::unique_ptr<Device>> m_devices; // Indexed by XInput device id
+    unsigned m_activeDevice = 0;
+    int m_xinputOpcode = 0;
+    std::optional<uint16_t> m_printedGroupNameId;
+    std::optional<OutputSink> m_output;
+    std::optional<Server> m_server;
+    std::vector<Server::Request> m_requests;
+    std::optional<EventLoop> m_ownEventLoop;
+    EventLoop *m_eventLoop = nullptr;
+    uint32_t m_sourcesBase;
+    std::vector<XkbEvent> m_events;
+    std::optional<Parameters> m_parameters;
+    std::optional<SettingsWatcher> m_settingsWatcher;
+
+    Statistics m_statistics;
+    std::optional<TraceRing> m_trace;
+    std::filesystem::path m_traceFile;
+    std::optional<EventRecorder> m_recorder;
+    uint64_t m_eventsCount = 0;
+    size_t m_skippedFocusChanges = 0;
+
+    // Destroy events could be missed, so tracked windows are periodically checked against the client list
+    std::optional<std::chrono::steady_clock::time_point> m_reconcileTime;
+    size_t m_staleWindowsRemoved = 0;
+
     bool m_needProcessEvents;
-    bool m_useDifferentGroups;
-    bool m_useDifferentLayouts;
-    bool m_printGroups;
+    bool m_fullGroupNames;
+    bool m_perDevice = false;
 };
 
 #endif // KEYBOARDDAEMON_H
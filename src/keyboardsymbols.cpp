@@ -20,6 +20,7 @@
 #include "keyboardsymbols.h"
 
 #include "x11deleters.h"
+#include "xrequests.h"
 
 #include <boost/spirit/home/x3.hpp>
 
@@ -41,11 +42,14 @@ BOOST_SPIRIT_DEFINE(symbolsRule, groupsRule, optionsRule);
 
 KeyboardSymbols KeyboardSymbols::currentSymbols(Display &display)
 {
-    const std::unique_ptr<XkbDescRec, XlibDeleter> currentDesc(XkbGetKeyboardByName(&display, XkbUseCoreKbd, nullptr, XkbGBN_ServerSymbolsMask, 0, false));
-    if (!currentDesc)
+    // Only the symbols name is needed, the server doesn't have to send the keymap
+    const std::unique_ptr<XkbDescRec, DescDeleter> currentDesc(XkbAllocKeyboard());
+    countReply();
+    if (!currentDesc || XkbGetNames(&display, XkbSymbolsNameMask, currentDesc.get()) != Success || !currentDesc->names)
         throw std::logic_error("Unable to get keyboard symbols");
 
     KeyboardSymbols symbols;
+    countReply();
     const std::unique_ptr<char[], XlibDeleter> currentSymbols(XGetAtomName(&display, currentDesc->names->symbols));
     x3::parse(currentSymbols.get(), currentSymbols.get() + strlen(currentSymbols.get()), symbolsRule, symbols);
 
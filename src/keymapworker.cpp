@@ -0,0 +1,138 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "keymapworker.h"
+
+#include "layout.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <system_error>
+
+#include <csignal>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <X11/XKBlib.h>
+
+// The daemon notices the lost server through its own connection, failed keymaps are compiled again on use
+static void ignoreDisconnection(Display *, void *)
+{
+}
+
+KeymapWorker::KeymapWorker(const char *displayName)
+    : m_display(XOpenDisplay(displayName))
+    , m_requestFd(eventfd(0, EFD_CLOEXEC))
+    , m_readyFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+    if (m_requestFd == -1 || m_readyFd == -1) {
+        const int error = errno;
+        close(m_requestFd);
+        close(m_readyFd);
+        throw std::system_error(error, std::system_category(), "Unable to create keymap worker descriptors");
+    }
+    if (!m_display) {
+        close(m_requestFd);
+        close(m_readyFd);
+        throw std::logic_error("Unable to connect keymap worker to X server");
+    }
+    XSetIOErrorExitHandler(m_display.get(), ignoreDisconnection, nullptr);
+
+    // Signals are handled by the event loop of the main thread
+    sigset_t signals;
+    sigset_t oldSignals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, &oldSignals);
+    m_thread = std::thread(&KeymapWorker::run, this);
+    pthread_sigmask(SIG_SETMASK, &oldSignals, nullptr);
+}
+
+KeymapWorker::~KeymapWorker()
+{
+    m_stopped = true;
+    constexpr uint64_t wakeup = 1;
+    while (write(m_requestFd, &wakeup, sizeof(wakeup)) == -1 && errno == EINTR) {
+    }
+    m_thread.join();
+
+    close(m_requestFd);
+    close(m_readyFd);
+}
+
+bool KeymapWorker::prepare(const std::string &symbols)
+{
+    // Each pending keymap has a place in both queues
+    if (m_pendingSymbols.size() == queueCapacity || std::find(m_pendingSymbols.cbegin(), m_pendingSymbols.cend(), symbols) != m_pendingSymbols.cend())
+        return false;
+    if (!m_requests.push(symbols))
+        return false;
+
+    m_pendingSymbols.push_back(symbols);
+    constexpr uint64_t wakeup = 1;
+    if (write(m_requestFd, &wakeup, sizeof(wakeup)) == -1)
+        throw std::system_error(errno, std::system_category(), "Unable to wake up keymap worker");
+    return true;
+}
+
+int KeymapWorker::fd() const
+{
+    return m_readyFd;
+}
+
+std::vector<KeymapWorker::Keymap> KeymapWorker::takeKeymaps()
+{
+    // Reset the counter before taking keymaps, so keymaps pushed later will wake up the loop again
+    uint64_t count;
+    while (read(m_readyFd, &count, sizeof(count)) == -1 && errno == EINTR) {
+    }
+
+    std::vector<Keymap> keymaps;
+    while (std::optional<Keymap> keymap = m_keymaps.pop()) {
+        m_pendingSymbols.erase(std::find(m_pendingSymbols.begin(), m_pendingSymbols.end(), keymap->symbols));
+        keymaps.push_back(std::move(keymap.value()));
+    }
+    return keymaps;
+}
+
+void KeymapWorker::run()
+{
+    while (true) {
+        uint64_t count;
+        if (read(m_requestFd, &count, sizeof(count)) == -1 && errno == EINTR)
+            continue;
+        if (m_stopped)
+            return;
+
+        while (std::optional<std::string> symbols = m_requests.pop()) {
+            Keymap keymap{std::move(symbols.value()), nullptr};
+            try {
+                keymap.desc = Layout::compileKeymap(*m_display, keymap.symbols);
+            } catch (const std::logic_error &) {
+                // The main thread will compile the keymap again on use and report the error
+            }
+
+            // Pending keymaps are limited by the queue capacity, so there is always a place
+            m_keymaps.push(std::move(keymap));
+            constexpr uint64_t ready = 1;
+            while (write(m_readyFd, &ready, sizeof(ready)) == -1 && errno == EINTR) {
+            }
+        }
+    }
+}
@@ -0,0 +1,67 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef KEYMAPWORKER_H
+#define KEYMAPWORKER_H
+
+#include "spscqueue.h"
+#include "x11deleters.h"
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Compiles keymaps in a background thread with its own X connection, so the event loop doesn't wait for X server.
+// Symbols and compiled keymaps are passed through lock-free queues, the descriptor becomes readable when keymaps are ready.
+class KeymapWorker
+{
+public:
+    struct Keymap {
+        std::string symbols;
+        std::unique_ptr<XkbDescRec, DescDeleter> desc; // Empty if the symbols can't be compiled
+    };
+
+    explicit KeymapWorker(const char *displayName);
+    KeymapWorker(const KeymapWorker &) = delete;
+    KeymapWorker &operator=(const KeymapWorker &) = delete;
+    ~KeymapWorker();
+
+    // Returns false if the symbols are already requested or too many keymaps are pending
+    bool prepare(const std::string &symbols);
+    [[nodiscard]] int fd() const;
+    [[nodiscard]] std::vector<Keymap> takeKeymaps();
+
+private:
+    void run();
+
+    static constexpr size_t queueCapacity = 16;
+
+    std::unique_ptr<Display, DisplayDeleter> m_display;
+    SpscQueue<std::string, queueCapacity> m_requests;
+    SpscQueue<Keymap, queueCapacity> m_keymaps;
+    std::vector<std::string> m_pendingSymbols; // Used only by the main thread
+    int m_requestFd;
+    int m_readyFd;
+    std::atomic<bool> m_stopped = false;
+    std::thread m_thread;
+};
+
+#endif // KEYMAPWORKER_H
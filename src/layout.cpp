@@ -19,9 +19,13 @@
 
 #include "layout.h"
 
+#include "xrequests.h"
+
 #include <boost/algorithm/string/join.hpp>
 #include <boost/tokenizer.hpp>
 
+#include <algorithm>
+
 #include <X11/XKBlib.h>
 #include <X11/extensions/XKBrules.h>
 
@@ -29,11 +33,17 @@ Layout::Layout(Display &display, std::string layout, const std::vector<std::stri
     : m_layoutString(std::move(layout))
     , m_display(display)
 {
+    boost::tokenizer layoutTokenizer(m_layoutString, boost::char_separator(","));
+    for (const std::string &group : layoutTokenizer)
+        m_groupNameIds.push_back(internGroupName(group));
+    if (m_groupNameIds.empty())
+        m_groupNameIds.push_back(internGroupName({}));
+    m_groupCodeIds = m_groupNameIds;
+
     if (options.empty())
         return;
 
     m_symbols = "pc+";
-    boost::tokenizer layoutTokenizer(m_layoutString, boost::char_separator(","));
     for (auto it = layoutTokenizer.begin(); it != layoutTokenizer.end(); ++it) {
         m_symbols += it.current_token();
         if (it != layoutTokenizer.begin())
@@ -41,43 +51,253 @@ Layout::Layout(Display &display, std::string layout, const std::vector<std::stri
         m_symbols += '+';
     }
 
-    m_symbols += boost::join(options, "+");
+    m_options = boost::join(options, "+");
+    m_symbols += m_options;
 }
 
-void Layout::apply()
+void Layout::apply(unsigned deviceSpec)
 {
-    // Replace layouts with specified and generate new symbols string
-    XkbComponentNamesRec currentComponents{};
-    currentComponents.symbols = m_symbols.data();
+    if (!m_desc)
+        compile();
+    m_desc->device_spec = static_cast<unsigned short>(deviceSpec);
 
-    // Send it back to X11
-    const std::unique_ptr<XkbDescRec, XlibDeleter> newDesc(XkbGetKeyboardByName(&m_display, XkbUseCoreKbd, &currentComponents, XkbGBN_SymbolsMask, 0, true));
-    if (!newDesc)
-        throw std::logic_error("Unable to build keyboard description with the following symbols: " + m_symbols);
+    // Upload cached description, the server doesn't need to compile symbols again
+    if (!XkbSetMap(&m_display, XkbAllMapComponentsMask, m_desc.get()) || !XkbSetNames(&m_display, XkbSymbolsNameMask | XkbGroupNamesMask, 0, 0, m_desc.get()))
+        throw std::logic_error("Unable to upload keyboard description with the following symbols: " + m_symbols);
 
-    if (s_currentVarDefs) {
-        s_currentVarDefs->layout = m_layoutString.data();
-        if (!XkbRF_SetNamesProp(&m_display, s_currentRulesPath.get(), s_currentVarDefs.get()))
+    if (deviceSpec != XkbUseCoreKbd)
+        return;
+    if (const auto it = s_keyboardRules.find(&m_display); it != s_keyboardRules.end()) {
+        KeyboardRules &rules = it->second;
+        rules.varDefs->layout = m_layoutString.data();
+        if (!XkbRF_SetNamesProp(&m_display, rules.path.get(), rules.varDefs.get()))
             throw std::logic_error("Unable to set keyboard rules for " + m_symbols);
     }
 }
 
+bool Layout::hasSameSymbols(const Layout &other) const
+{
+    return m_layoutString == other.m_layoutString && m_symbols == other.m_symbols;
+}
+
+const std::string &Layout::layoutString() const
+{
+    return m_layoutString;
+}
+
+std::optional<std::vector<unsigned char>> Layout::groupsIn(const Layout &keymap) const
+{
+    if (m_symbols.empty() || m_options != keymap.m_options || m_groupNameIds.size() != keymap.m_groupNameIds.size())
+        return std::nullopt;
+
+    // Layout codes are compared, names could be replaced by full ones
+    const boost::tokenizer keymapTokenizer(keymap.m_layoutString, boost::char_separator(","));
+    std::vector<std::string> keymapGroups(keymapTokenizer.begin(), keymapTokenizer.end());
+    std::vector<unsigned char> groups;
+    groups.reserve(keymapGroups.size());
+    for (const std::string &group : boost::tokenizer(m_layoutString, boost::char_separator(","))) {
+        const auto it = std::find(keymapGroups.begin(), keymapGroups.end(), group);
+        if (it == keymapGroups.end())
+            return std::nullopt;
+
+        // Each group of the keymap is matched once
+        it->clear();
+        groups.push_back(static_cast<unsigned char>(it - keymapGroups.begin()));
+    }
+
+    return groups;
+}
+
 std::string_view Layout::groupName(unsigned char group) const
 {
-    return {m_layoutString.data() + group * 2 + group, 2};
+    return s_groupNames[groupNameId(group)];
+}
+
+std::string_view Layout::groupCode(unsigned char group) const
+{
+    return s_groupNames[m_groupCodeIds[group % m_groupCodeIds.size()]];
+}
+
+uint16_t Layout::groupNameId(unsigned char group) const
+{
+    // XKB wraps group indices that exceed the number of groups
+    return m_groupNameIds[group % m_groupNameIds.size()];
+}
+
+unsigned char Layout::groupsCount() const
+{
+    return static_cast<unsigned char>(m_groupNameIds.size());
+}
+
+KeyCode Layout::keycode(KeySym keysym)
+{
+    if (!m_desc) {
+        if (m_symbols.empty())
+            loadServerKeymap();
+        else
+            compile();
+    }
+
+    // Prefer lower groups and levels like XKeysymToKeycode
+    const XkbDescRec &desc = *m_desc;
+    for (unsigned char group = 0; group < XkbNumKbdGroups; ++group) {
+        for (int level = 0; level < XkbMaxShiftLevel; ++level) {
+            bool hasLevel = false;
+            for (int keycode = desc.min_key_code; keycode <= desc.max_key_code; ++keycode) {
+                if (group >= XkbKeyNumGroups(&desc, keycode) || level >= XkbKeyGroupWidth(&desc, keycode, group))
+                    continue;
+                hasLevel = true;
+                if (XkbKeySymEntry(&desc, keycode, level, group) == keysym)
+                    return static_cast<KeyCode>(keycode);
+            }
+            if (!hasLevel)
+                break;
+        }
+    }
+
+    return 0;
+}
+
+bool Layout::needsCompile() const
+{
+    return !m_desc && !m_symbols.empty();
+}
+
+const std::string &Layout::symbols() const
+{
+    return m_symbols;
+}
+
+void Layout::setKeymap(std::unique_ptr<XkbDescRec, DescDeleter> desc)
+{
+    // Atoms of the description are the same for all connections
+    desc->dpy = &m_display;
+    m_desc = std::move(desc);
+}
+
+std::unique_ptr<XkbDescRec, DescDeleter> Layout::compileKeymap(Display &display, const std::string &symbols)
+{
+    // Replace layouts with specified and generate new symbols string
+    XkbComponentNamesRec currentComponents{};
+    std::string symbolsCopy = symbols;
+    currentComponents.symbols = symbolsCopy.data();
+
+    // Compile without loading, the result will be uploaded on apply
+    constexpr unsigned components = XkbGBN_TypesMask | XkbGBN_SymbolsMask | XkbGBN_OtherNamesMask;
+    std::unique_ptr<XkbDescRec, DescDeleter> desc(XkbGetKeyboardByName(&display, XkbUseCoreKbd, &currentComponents, components, XkbGBN_SymbolsMask, false));
+    if (!desc)
+        throw std::logic_error("Unable to build keyboard description with the following symbols: " + symbols);
+    return desc;
+}
+
+bool Layout::refreshKeys(int firstKeycode, int count)
+{
+    if (!m_symbols.empty())
+        return false;
+
+    // The whole keymap was changed, key types could be different too
+    if (!m_desc || (firstKeycode <= m_desc->min_key_code && firstKeycode + count > m_desc->max_key_code)) {
+        loadServerKeymap();
+        return true;
+    }
+
+    countReply();
+    if (XkbGetKeySyms(&m_display, static_cast<unsigned>(firstKeycode), static_cast<unsigned>(count), m_desc.get()) != Success)
+        throw std::logic_error("Unable to get changed keys");
+    return true;
+}
+
+void Layout::loadFullGroupNames()
+{
+    std::unique_ptr<XkbDescRec, DescDeleter> serverDesc;
+    const XkbDescRec *desc;
+    if (m_symbols.empty()) {
+        serverDesc.reset(XkbAllocKeyboard());
+        countReply();
+        if (!serverDesc || XkbGetNames(&m_display, XkbGroupNamesMask, serverDesc.get()) != Success)
+            throw std::logic_error("Unable to get group names");
+        desc = serverDesc.get();
+    } else {
+        if (!m_desc)
+            compile();
+        desc = m_desc.get();
+    }
+
+    if (!desc->names)
+        return;
+
+    // Request all names at once, groups without names keep layout codes
+    std::vector<Atom> atoms;
+    std::vector<size_t> groups;
+    for (size_t group = 0; group < std::min<size_t>(m_groupNameIds.size(), XkbNumKbdGroups); ++group) {
+        if (desc->names->groups[group] != None) {
+            atoms.push_back(desc->names->groups[group]);
+            groups.push_back(group);
+        }
+    }
+    if (atoms.empty())
+        return;
+
+    std::vector<char *> names(atoms.size());
+    countReply();
+    if (!XGetAtomNames(&m_display, atoms.data(), static_cast<int>(atoms.size()), names.data()))
+        throw std::logic_error("Unable to get group names for " + m_layoutString);
+
+    for (size_t i = 0; i < names.size(); ++i) {
+        const std::unique_ptr<char[], XlibDeleter> name(names[i]);
+        m_groupNameIds[groups[i]] = internGroupName(name.get());
+    }
+}
+
+void Layout::compile()
+{
+    // Keymaps prepared by another thread are not counted, they don't block the event loop
+    countReply();
+    m_desc = compileKeymap(m_display, m_symbols);
+}
+
+void Layout::loadServerKeymap()
+{
+    countReply();
+    m_desc.reset(XkbGetMap(&m_display, XkbKeyTypesMask | XkbKeySymsMask, XkbUseCoreKbd));
+    if (!m_desc)
+        throw std::logic_error("Unable to get current keyboard description");
+}
+
+uint16_t Layout::internGroupName(std::string name)
+{
+    const auto it = std::find(s_groupNames.cbegin(), s_groupNames.cend(), name);
+    if (it != s_groupNames.cend())
+        return static_cast<uint16_t>(it - s_groupNames.cbegin());
+
+    s_groupNames.push_back(std::move(name));
+    return static_cast<uint16_t>(s_groupNames.size() - 1);
 }
 
 void Layout::saveKeyboardRules(Display &display)
 {
     char *path;
-    s_currentVarDefs.reset(new XkbRF_VarDefsRec);
+    std::unique_ptr<XkbRF_VarDefsRec, VarDefsWithoutLayoutDeleter> varDefs(new XkbRF_VarDefsRec{});
 
-    if (!XkbRF_GetNamesProp(&display, &path, s_currentVarDefs.get()))
+    countReply();
+    if (!XkbRF_GetNamesProp(&display, &path, varDefs.get()))
         throw std::logic_error("Unable to get keyboard rules");
 
-    s_currentRulesPath.reset(path);
-
     // Free layout to replace it with pointer to std::string later
-    if (s_currentVarDefs->layout)
-        XFree(s_currentVarDefs->layout);
+    if (varDefs->layout)
+        XFree(varDefs->layout);
+
+    KeyboardRules &rules = s_keyboardRules[&display];
+    rules.path.reset(path);
+    rules.varDefs = std::move(varDefs);
+}
+
+bool Layout::hasKeyboardRules(const Display &display)
+{
+    return s_keyboardRules.find(&display) != s_keyboardRules.end();
+}
+
+void Layout::forgetKeyboardRules(const Display &display)
+{
+    s_keyboardRules.erase(&display);
 }
@@ -22,28 +22,76 @@
 
 #include "x11deleters.h"
 
+#include <cstdint>
 #include <memory>
+#include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include <X11/extensions/XKB.h>
+
 class Layout
 {
 public:
     explicit Layout(Display &display, std::string layout, const std::vector<std::string> &options = {});
 
-    void apply();
+    // Keyboard rules are updated only for the core keyboard
+    void apply(unsigned deviceSpec = XkbUseCoreKbd);
+    // Layouts with the same symbols produce the same keymap
+    [[nodiscard]] bool hasSameSymbols(const Layout &other) const;
+    // Comma-separated groups as specified, e.g. "us,ru"
+    [[nodiscard]] const std::string &layoutString() const;
+    // Index of each group in the keymap of the other layout if it has the same groups in another order
+    [[nodiscard]] std::optional<std::vector<unsigned char>> groupsIn(const Layout &keymap) const;
 
     [[nodiscard]] std::string_view groupName(unsigned char group) const;
+    // Layout code from the rules, e.g. "us", even if full group names were loaded
+    [[nodiscard]] std::string_view groupCode(unsigned char group) const;
+    // Equal ids mean equal names, even for different layouts
+    [[nodiscard]] uint16_t groupNameId(unsigned char group) const;
+    [[nodiscard]] unsigned char groupsCount() const;
+    // Replaces layout codes with group names from XKB
+    void loadFullGroupNames();
+    [[nodiscard]] KeyCode keycode(KeySym keysym);
+
+    // Keymap is compiled on the first use unless it was prepared in advance
+    [[nodiscard]] bool needsCompile() const;
+    // Compiles the keymap before the first use, e.g. to check new settings
+    void compile();
+    [[nodiscard]] const std::string &symbols() const;
+    // Takes a keymap compiled by another connection to the same server
+    void setKeymap(std::unique_ptr<XkbDescRec, DescDeleter> desc);
+    [[nodiscard]] static std::unique_ptr<XkbDescRec, DescDeleter> compileKeymap(Display &display, const std::string &symbols);
+
+    // Reloads changed keys for layout that uses current server keymap, returns false for compiled layouts
+    bool refreshKeys(int firstKeycode, int count);
 
     static void saveKeyboardRules(Display &display);
+    [[nodiscard]] static bool hasKeyboardRules(const Display &display);
+    // Should be called before the display is closed, another connection could get the same address
+    static void forgetKeyboardRules(const Display &display);
 
 private:
+    void loadServerKeymap();
+
+    [[nodiscard]] static uint16_t internGroupName(std::string name);
+
     std::string m_layoutString;
     std::string m_symbols;
+    std::string m_options;
+    std::vector<uint16_t> m_groupNameIds;
+    std::vector<uint16_t> m_groupCodeIds;
+    std::unique_ptr<XkbDescRec, DescDeleter> m_desc;
     Display &m_display;
 
-    static inline std::unique_ptr<XkbRF_VarDefsRec, VarDefsWithoutLayoutDeleter> s_currentVarDefs;
-    static inline std::unique_ptr<char[], XlibDeleter> s_currentRulesPath;
+    struct KeyboardRules {
+        std::unique_ptr<XkbRF_VarDefsRec, VarDefsWithoutLayoutDeleter> varDefs;
+        std::unique_ptr<char[], XlibDeleter> path;
+    };
+
+    static inline std::unordered_map<const Display *, KeyboardRules> s_keyboardRules; // A process could serve several displays
+    static inline std::vector<std::string> s_groupNames; // Interned across all layouts
 };
 
 #endif // LAYOUT_H
@@ -17,7 +17,9 @@
  *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "daemonclient.h"
 #include "keyboarddaemon.h"
+#include "multidisplaydaemon.h"
 #include "parameters.h"
 
 #include <boost/program_options.hpp>
@@ -25,13 +27,30 @@
 #include <filesystem>
 #include <iostream>
 
+#include <X11/Xlib.h>
+
 int main(int argc, char *argv[])
 {
+    // Asking the running daemon is much faster than connecting to X server
+    if (const std::optional<int> exitCode = runDaemonCommand(argc, argv); exitCode)
+        return exitCode.value();
+
     try {
         const Parameters parameters(argc, argv);
         if (parameters.isPrintInfoOnly())
             return 0;
 
+        // Keymap workers use their own connections, but Xlib also has global state
+        if (parameters.isPrepareKeymaps() && !parameters.isOneShotCommand())
+            XInitThreads();
+
+        // One-shot commands are performed only for $DISPLAY
+        if (const std::vector<std::string> displays = parameters.displays(); !displays.empty() && !parameters.isOneShotCommand()) {
+            MultiDisplayDaemon daemon(parameters, displays);
+            daemon.processEvents();
+            return 0;
+        }
+
         KeyboardDaemon daemon(parameters);
         if (daemon.needProcessEvents())
             daemon.processEvents();
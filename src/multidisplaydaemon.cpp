@@ -0,0 +1,120 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "multidisplaydaemon.h"
+
+#include "parameters.h"
+
+#include <algorithm>
+#include <csignal>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+
+MultiDisplayDaemon::MultiDisplayDaemon(const Parameters &parameters, const std::vector<std::string> &displays)
+    : m_displays(displays)
+{
+    // Output can't be shared and recordings are replayed for a single display
+    if (parameters.isPrintGroups())
+        throw std::logic_error("Groups can't be printed for several displays, use the socket instead");
+    if (parameters.recordFile())
+        throw std::logic_error("Events can't be recorded for several displays");
+
+    // Displays that can't be served are skipped, their slots stay empty to keep source ids
+    m_daemons.reserve(displays.size());
+    for (const std::string &display : displays) {
+        const auto sourcesBase = static_cast<uint32_t>(m_daemons.size() * KeyboardDaemon::sourcesCount);
+        try {
+            m_daemons.push_back(std::make_unique<KeyboardDaemon>(parameters, display.c_str(), &m_eventLoop, sourcesBase));
+        } catch (const std::exception &error) {
+            std::cerr << "Unable to serve display " << display << ": " << error.what() << std::endl;
+            m_daemons.emplace_back();
+        }
+    }
+    if (std::all_of(m_daemons.cbegin(), m_daemons.cend(), std::logical_not()))
+        throw std::logic_error("Unable to serve any of the specified displays");
+
+    m_sources.resize(m_daemons.size());
+}
+
+void MultiDisplayDaemon::processEvents()
+{
+    while (true) {
+        for (std::vector<uint32_t> &sources : m_sources)
+            sources.clear();
+
+        // Also flushes requests from the previous commits
+        const bool hasQueuedEvents = std::any_of(m_daemons.cbegin(), m_daemons.cend(), [](const std::unique_ptr<KeyboardDaemon> &daemon) {
+            return daemon && daemon->hasQueuedEvents();
+        });
+        if (!hasQueuedEvents) {
+            std::optional<std::chrono::steady_clock::time_point> deadline;
+            for (const std::unique_ptr<KeyboardDaemon> &daemon : m_daemons) {
+                if (!daemon)
+                    continue;
+                if (const std::optional<std::chrono::steady_clock::time_point> daemonDeadline = daemon->nextDeadline(); daemonDeadline && (!deadline || daemonDeadline < deadline))
+                    deadline = daemonDeadline;
+            }
+            m_eventLoop.setDeadline(deadline);
+
+            for (const uint32_t source : m_eventLoop.wait())
+                m_sources[source / KeyboardDaemon::sourcesCount].push_back(source % KeyboardDaemon::sourcesCount);
+            if (m_eventLoop.isTerminated())
+                return;
+
+            if (m_eventLoop.takeUserSignal(SIGUSR1)) {
+                for (const std::unique_ptr<KeyboardDaemon> &daemon : m_daemons) {
+                    if (daemon)
+                        daemon->printStatistics();
+                }
+            }
+            if (m_eventLoop.takeUserSignal(SIGUSR2)) {
+                for (const std::unique_ptr<KeyboardDaemon> &daemon : m_daemons) {
+                    if (daemon)
+                        daemon->saveTrace();
+                }
+            }
+        }
+
+        for (size_t i = 0; i < m_daemons.size(); ++i) {
+            if (m_daemons[i])
+                processBatch(i);
+        }
+        if (std::all_of(m_daemons.cbegin(), m_daemons.cend(), std::logical_not()))
+            throw std::logic_error("Connections to all displays were lost");
+    }
+}
+
+void MultiDisplayDaemon::processBatch(size_t index)
+{
+    // Requests to the lost display fail, so errors are expected until the connection is checked
+    std::unique_ptr<KeyboardDaemon> &daemon = m_daemons[index];
+    try {
+        daemon->processBatch(m_sources[index]);
+    } catch (const std::exception &) {
+        if (daemon->isConnected())
+            throw;
+    }
+    if (daemon->isConnected())
+        return;
+
+    // Destroying the daemon also removes its descriptors from the event loop
+    std::cerr << "Connection to display " << m_displays[index] << " was lost, other displays are still served" << std::endl;
+    daemon.reset();
+}
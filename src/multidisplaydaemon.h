@@ -0,0 +1,53 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MULTIDISPLAYDAEMON_H
+#define MULTIDISPLAYDAEMON_H
+
+#include "eventloop.h"
+#include "keyboarddaemon.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class Parameters;
+
+// Serves several X displays from one process, e.g. sessions of a terminal server.
+// Daemons share the event loop, the settings and interned group names, but keep their own keyboard state.
+// Lost displays stop being served without affecting the others.
+class MultiDisplayDaemon
+{
+public:
+    MultiDisplayDaemon(const Parameters &parameters, const std::vector<std::string> &displays);
+
+    // Returns after termination signal
+    void processEvents();
+
+private:
+    // Destroys the daemon if its connection was lost
+    void processBatch(size_t index);
+
+    EventLoop m_eventLoop;
+    std::vector<std::string> m_displays;
+    std::vector<std::unique_ptr<KeyboardDaemon>> m_daemons; // Empty for displays that aren't served
+    std::vector<std::vector<uint32_t>> m_sources; // Ready sources of each daemon
+};
+
+#endif // MULTIDISPLAYDAEMON_H
@@ -0,0 +1,147 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "outputsink.h"
+
+#include <algorithm>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+OutputSink::OutputSink(int fd)
+    : m_fd(fd)
+{
+    // Only readers of pipes and sockets can stall, other files could be shared with the parent process and stay as they are
+    struct stat status;
+    if (fstat(fd, &status) == -1 || (!S_ISFIFO(status.st_mode) && !S_ISSOCK(status.st_mode)))
+        return;
+    m_socket = S_ISSOCK(status.st_mode);
+
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        throw std::system_error(errno, std::system_category(), "Unable to make output non-blocking");
+}
+
+void OutputSink::writeLine(std::string_view line)
+{
+    const size_t lineSize = line.size() + 1;
+    while (m_buffer.size() - m_size < lineSize) {
+        if (!dropOldestLine()) {
+            ++m_droppedLinesCount;
+            return;
+        }
+    }
+
+    for (const char character : line)
+        at(m_size++) = character;
+    at(m_size++) = '\n';
+
+    flush();
+}
+
+void OutputSink::flush()
+{
+    while (m_size != 0) {
+        // Data could wrap around the end of the buffer
+        const size_t firstPartSize = std::min(m_size, m_buffer.size() - m_begin);
+        std::array<iovec, 2> parts{{
+            {m_buffer.data() + m_begin, firstPartSize},
+            {m_buffer.data(), m_size - firstPartSize},
+        }};
+        const size_t partsCount = parts[1].iov_len != 0 ? 2 : 1;
+
+        ssize_t written;
+        if (m_socket) {
+            // Disconnected clients shouldn't terminate the process with SIGPIPE
+            msghdr message{};
+            message.msg_iov = parts.data();
+            message.msg_iovlen = partsCount;
+            written = sendmsg(m_fd, &message, MSG_NOSIGNAL);
+        } else {
+            written = writev(m_fd, parts.data(), static_cast<int>(partsCount));
+        }
+        if (written == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            throw std::system_error(errno, std::system_category(), "Unable to write output");
+        }
+
+        consume(static_cast<size_t>(written));
+    }
+}
+
+bool OutputSink::hasPendingData() const
+{
+    return m_size != 0;
+}
+
+size_t OutputSink::droppedLinesCount() const
+{
+    return m_droppedLinesCount;
+}
+
+int OutputSink::fd() const
+{
+    return m_fd;
+}
+
+char &OutputSink::at(size_t index)
+{
+    return m_buffer[(m_begin + index) % m_buffer.size()];
+}
+
+void OutputSink::consume(size_t size)
+{
+    // Written data ends in the middle of a line if there is no line break at the end
+    if (size != 0)
+        m_headWritten = at(size - 1) != '\n';
+    m_begin = (m_begin + size) % m_buffer.size();
+    m_size -= size;
+}
+
+bool OutputSink::dropOldestLine()
+{
+    size_t lineBegin = 0;
+    if (m_headWritten) {
+        while (lineBegin != m_size && at(lineBegin) != '\n')
+            ++lineBegin;
+        ++lineBegin;
+    }
+
+    size_t lineEnd = lineBegin;
+    while (lineEnd < m_size && at(lineEnd) != '\n')
+        ++lineEnd;
+    if (lineEnd >= m_size)
+        return false;
+
+    // Shift the partially written line to the place of the dropped one
+    const size_t lineSize = lineEnd - lineBegin + 1;
+    for (size_t i = lineBegin; i != 0; --i)
+        at(i - 1 + lineSize) = at(i - 1);
+    m_begin = (m_begin + lineSize) % m_buffer.size();
+    m_size -= lineSize;
+    ++m_droppedLinesCount;
+    return true;
+}
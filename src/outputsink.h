@@ -0,0 +1,57 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef OUTPUTSINK_H
+#define OUTPUTSINK_H
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+
+// Writes lines through a small ring buffer without blocking on pipes and sockets.
+// If the reader doesn't keep up, the oldest lines are dropped to keep the newest state.
+class OutputSink
+{
+public:
+    explicit OutputSink(int fd);
+
+    void writeLine(std::string_view line);
+    // Writes as much buffered data as possible
+    void flush();
+
+    [[nodiscard]] bool hasPendingData() const;
+    [[nodiscard]] size_t droppedLinesCount() const;
+    [[nodiscard]] int fd() const;
+
+private:
+    [[nodiscard]] char &at(size_t index);
+    void consume(size_t size);
+    // Returns false if there are no complete lines that weren't partially written
+    bool dropOldestLine();
+
+    std::array<char, 4096> m_buffer;
+    size_t m_begin = 0;
+    size_t m_size = 0;
+    bool m_headWritten = false; // First line was partially written and can't be dropped
+    size_t m_droppedLinesCount = 0;
+    int m_fd;
+    bool m_socket = false;
+};
+
+#endif // OUTPUTSINK_H
@@ -20,6 +20,7 @@
 #include "parameters.h"
 
 #include "cmake.h"
+#include "server.h"
 
 #include <boost/format.hpp>
 #include <boost/program_options.hpp>
@@ -31,6 +32,8 @@ namespace po = boost::program_options;
 namespace fs = std::filesystem;
 
 Parameters::Parameters(int argc, char *argv[])
+    : m_argc(argc)
+    , m_argv(argv)
 {
     po::options_description commands("Commands");
     commands.add_options()("help,h", "Print usage information and exit.");
@@ -47,10 +50,29 @@ Parameters::Parameters(int argc, char *argv[])
     daemonConfiguration.add_options()("general.different-groups,g", po::bool_switch(), "Use different groups for each window.");
     daemonConfiguration.add_options()("general.different-layout,a", po::bool_switch(), "Use different layouts for each window.");
     daemonConfiguration.add_options()("general.print-groups,p", po::bool_switch(), "Print switched languages in stdout.");
+    daemonConfiguration.add_options()("general.full-group-names", po::bool_switch(), "Print full group names from XKB instead of layout codes.");
+#ifdef WITH_XINPUT
+    daemonConfiguration.add_options()("general.per-device", po::bool_switch(), "Track layouts and groups separately for each keyboard device.");
+#endif
     daemonConfiguration.add_options()("general.layouts,l", po::value<std::vector<std::string>>()->multitoken(), "Languages separated by ','. Can be specified several times to define several layouts.");
     daemonConfiguration.add_options()("general.default-group,e", po::value<unsigned>(), "The index of the group to switch when changing the layout.");
     daemonConfiguration.add_options()("general.skip-rules", po::bool_switch(), "Do not update keyboard rules. Improves performance, but other applications won't be aware of the layout changes. Use with caution.");
+    daemonConfiguration.add_options()("general.prepare-keymaps", po::bool_switch(), "Compile keymaps of the next and previous layouts in a background thread with its own X connection.");
+    daemonConfiguration.add_options()("general.commit-delay", po::value<unsigned>()->value_name("ms")->default_value(0), "Collect layout and group changes for the specified time before applying only the latest ones. By default changes are applied as soon as all pending events are processed.");
+    daemonConfiguration.add_options()("general.max-windows", po::value<size_t>()->value_name("count")->default_value(0), "Maximum number of windows to remember, least recently used windows will be forgotten first. 0 means unlimited.");
+    daemonConfiguration.add_options()("general.state-file", po::value<fs::path>()->value_name("path"), "File to remember groups and layouts of windows and applications across restarts.");
+    daemonConfiguration.add_options()("general.trace-file", po::value<fs::path>()->value_name("path"), "Record recent events in memory and write them to the specified file in Chrome trace format on SIGUSR2 or dump-trace socket command.");
+    daemonConfiguration.add_options()("general.record-file", po::value<fs::path>()->value_name("path"), "Write all processed events to the specified file to replay them later with akd_replay.");
+    daemonConfiguration.add_options()("general.socket", po::value<fs::path>()->value_name("path")->implicit_value(Server::defaultPath()), "Unix socket to serve group queries, changes and subscriptions. One-shot commands use the socket at the default path to ask the running daemon.");
+    daemonConfiguration.add_options()("general.displays", po::value<std::vector<std::string>>()->value_name("display")->multitoken(), "Serve the specified X displays from a single process instead of $DISPLAY. Each display uses the socket at its default path.");
     daemonConfiguration.add_options()("shortcuts.nextlayout,n", po::value<std::string>()->value_name("shortcut"), "Shortcut to switch to next layout.");
+    daemonConfiguration.add_options()("shortcuts.previouslayout", po::value<std::string>()->value_name("shortcut"), "Shortcut to switch to previous layout.");
+    daemonConfiguration.add_options()("shortcuts.lastlayout", po::value<std::string>()->value_name("shortcut"), "Shortcut to switch to the last used layout.");
+    daemonConfiguration.add_options()("shortcuts.setlayout", po::value<std::vector<std::string>>()->value_name("shortcut"), "Shortcut to switch to the layout with the specified index in \"<index> <shortcut>\" format. Can be specified several times.");
+    daemonConfiguration.add_options()("shortcuts.setgroup", po::value<std::vector<std::string>>()->value_name("shortcut"), "Shortcut to switch to the group with the specified index in \"<index> <shortcut>\" format. Can be specified several times.");
+    daemonConfiguration.add_options()("rules.class", po::value<std::vector<std::string>>()->value_name("rule"), "Initial group and layout for windows by WM_CLASS instance or class name in \"<group>[:<layout>] <pattern>\" format. Can be specified several times.");
+    daemonConfiguration.add_options()("rules.role", po::value<std::vector<std::string>>()->value_name("rule"), "Initial group and layout for windows by WM_WINDOW_ROLE. Can be specified several times.");
+    daemonConfiguration.add_options()("rules.title", po::value<std::vector<std::string>>()->value_name("rule"), "Initial group and layout for windows by title. Can be specified several times.");
 
     po::options_description allOptions;
     allOptions.add(commands).add(settings).add(daemonConfiguration);
@@ -97,9 +119,14 @@ bool Parameters::isSwitchToNextGroup() const
     return m_parameters["next-group"].as<bool>();
 }
 
-std::optional<unsigned char> Parameters::groupToSet() const
+std::optional<unsigned> Parameters::groupToSet() const
 {
-    return findOptional<unsigned char>("set-group");
+    return findOptional<unsigned>("set-group");
+}
+
+bool Parameters::isOneShotCommand() const
+{
+    return isPrintCurrentGroup() || isPrintCurrentGroupIndex() || isSwitchToNextGroup() || groupToSet();
 }
 
 bool Parameters::isPrintInfoOnly() const
@@ -107,6 +134,16 @@ bool Parameters::isPrintInfoOnly() const
     return m_printInfoOnly;
 }
 
+Parameters Parameters::reload() const
+{
+    return {m_argc, m_argv};
+}
+
+fs::path Parameters::settingsPath() const
+{
+    return m_parameters["settings"].as<fs::path>();
+}
+
 bool Parameters::isUseDifferentGroups() const
 {
     return m_parameters["general.different-groups"].as<bool>();
@@ -122,11 +159,60 @@ bool Parameters::isPrintGroups() const
     return m_parameters["general.print-groups"].as<bool>();
 }
 
+bool Parameters::isFullGroupNames() const
+{
+    return m_parameters["general.full-group-names"].as<bool>();
+}
+
+bool Parameters::isPerDevice() const
+{
+#ifdef WITH_XINPUT
+    return m_parameters["general.per-device"].as<bool>();
+#else
+    return false;
+#endif
+}
+
 bool Parameters::isSkipRules() const
 {
     return m_parameters["general.skip-rules"].as<bool>();
 }
 
+bool Parameters::isPrepareKeymaps() const
+{
+    return m_parameters["general.prepare-keymaps"].as<bool>();
+}
+
+std::chrono::milliseconds Parameters::commitDelay() const
+{
+    return std::chrono::milliseconds(m_parameters["general.commit-delay"].as<unsigned>());
+}
+
+size_t Parameters::maxWindows() const
+{
+    return m_parameters["general.max-windows"].as<size_t>();
+}
+
+std::optional<fs::path> Parameters::stateFile() const
+{
+    return findOptional<fs::path>("general.state-file");
+}
+
+std::optional<fs::path> Parameters::traceFile() const
+{
+    return findOptional<fs::path>("general.trace-file");
+}
+
+std::optional<fs::path> Parameters::recordFile() const
+{
+    return findOptional<fs::path>("general.record-file");
+}
+
+std::optional<fs::path> Parameters::socketPath() const
+{
+    return findOptional<fs::path>("general.socket");
+}
+
 std::optional<unsigned char> Parameters::defaultGroup() const
 {
     return findOptional<unsigned char>("general.default-group");
@@ -142,6 +228,46 @@ std::optional<std::string> Parameters::nextLayoutShortcut() const
     return findOptional<std::string>("shortcuts.nextlayout");
 }
 
+std::optional<std::string> Parameters::previousLayoutShortcut() const
+{
+    return findOptional<std::string>("shortcuts.previouslayout");
+}
+
+std::optional<std::string> Parameters::lastLayoutShortcut() const
+{
+    return findOptional<std::string>("shortcuts.lastlayout");
+}
+
+std::vector<std::string> Parameters::displays() const
+{
+    return findOptional<std::vector<std::string>>("general.displays").value_or(std::vector<std::string>());
+}
+
+std::vector<std::string> Parameters::setLayoutShortcuts() const
+{
+    return findOptional<std::vector<std::string>>("shortcuts.setlayout").value_or(std::vector<std::string>());
+}
+
+std::vector<std::string> Parameters::setGroupShortcuts() const
+{
+    return findOptional<std::vector<std::string>>("shortcuts.setgroup").value_or(std::vector<std::string>());
+}
+
+std::vector<std::string> Parameters::windowClassRules() const
+{
+    return findOptional<std::vector<std::string>>("rules.class").value_or(std::vector<std::string>());
+}
+
+std::vector<std::string> Parameters::windowRoleRules() const
+{
+    return findOptional<std::vector<std::string>>("rules.role").value_or(std::vector<std::string>());
+}
+
+std::vector<std::string> Parameters::windowTitleRules() const
+{
+    return findOptional<std::vector<std::string>>("rules.title").value_or(std::vector<std::string>());
+}
+
 size_t Parameters::specifiedOptionsCount(const boost::program_options::options_description &optionsGroup) const
 {
     const std::ptrdiff_t count = std::count_if(optionsGroup.options().begin(), optionsGroup.options().end(), [this](const boost::shared_ptr<boost::program_options::option_description> &option) {
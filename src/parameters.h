@@ -23,6 +23,7 @@
 #include <boost/program_options/options_description.hpp>
 #include <boost/program_options/variables_map.hpp>
 
+#include <chrono>
 #include <filesystem>
 #include <optional>
 
@@ -32,20 +33,43 @@ public:
     Parameters(int argc, char *argv[]);
 
     [[nodiscard]] bool isPrintInfoOnly() const;
+    // Parses the same arguments with the current settings file
+    [[nodiscard]] Parameters reload() const;
+    [[nodiscard]] std::filesystem::path settingsPath() const;
 
     [[nodiscard]] bool isPrintCurrentGroup() const;
     [[nodiscard]] bool isPrintCurrentGroupIndex() const;
     [[nodiscard]] bool isSwitchToNextGroup() const;
-    [[nodiscard]] std::optional<unsigned char> groupToSet() const;
+    [[nodiscard]] std::optional<unsigned> groupToSet() const;
+    // Any of the above commands that exit right away
+    [[nodiscard]] bool isOneShotCommand() const;
 
     [[nodiscard]] bool isUseDifferentGroups() const;
     [[nodiscard]] bool useDifferentLayouts() const;
     [[nodiscard]] bool isPrintGroups() const;
+    [[nodiscard]] bool isFullGroupNames() const;
+    [[nodiscard]] bool isPerDevice() const;
     [[nodiscard]] bool isSkipRules() const;
+    [[nodiscard]] bool isPrepareKeymaps() const;
+    [[nodiscard]] std::chrono::milliseconds commitDelay() const;
+    [[nodiscard]] size_t maxWindows() const;
+    [[nodiscard]] std::optional<std::filesystem::path> stateFile() const;
+    [[nodiscard]] std::optional<std::filesystem::path> traceFile() const;
+    [[nodiscard]] std::optional<std::filesystem::path> recordFile() const;
+    [[nodiscard]] std::optional<std::filesystem::path> socketPath() const;
+    [[nodiscard]] std::vector<std::string> displays() const;
     [[nodiscard]] std::optional<unsigned char> defaultGroup() const;
 
     [[nodiscard]] std::optional<std::vector<std::string>> layouts() const;
     [[nodiscard]] std::optional<std::string> nextLayoutShortcut() const;
+    [[nodiscard]] std::optional<std::string> previousLayoutShortcut() const;
+    [[nodiscard]] std::optional<std::string> lastLayoutShortcut() const;
+    [[nodiscard]] std::vector<std::string> setLayoutShortcuts() const;
+    [[nodiscard]] std::vector<std::string> setGroupShortcuts() const;
+
+    [[nodiscard]] std::vector<std::string> windowClassRules() const;
+    [[nodiscard]] std::vector<std::string> windowRoleRules() const;
+    [[nodiscard]] std::vector<std::string> windowTitleRules() const;
 
 private:
     [[nodiscard]] size_t specifiedOptionsCount(const boost::program_options::options_description &optionsGroup) const;
@@ -56,6 +80,8 @@ private:
     [[nodiscard]] static std::filesystem::path defaultConfigPath();
 
     boost::program_options::variables_map m_parameters;
+    int m_argc;
+    char **m_argv;
     bool m_printInfoOnly;
 };
 
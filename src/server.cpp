@@ -0,0 +1,335 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "server.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstdlib>
+#include <system_error>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// Longer lines are not valid requests
+static constexpr size_t maxRequestLength = 64;
+
+// Used without XDG_RUNTIME_DIR, other users can't pre-create sockets in it
+static fs::path fallbackDirectory()
+{
+    return fs::temp_directory_path() / ("akd-" + std::to_string(getuid()));
+}
+
+Server::Client::Client(int fd)
+    : output(fd)
+{
+}
+
+Server::Server(fs::path path)
+    : m_path(std::move(path))
+    , m_socket(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))
+{
+    if (m_socket == -1)
+        throw std::system_error(errno, std::system_category(), "Unable to create socket");
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (m_path.native().size() >= sizeof(address.sun_path)) {
+        close(m_socket);
+        throw std::logic_error("Socket path is too long: " + m_path.string());
+    }
+    std::copy(m_path.native().cbegin(), m_path.native().cend(), address.sun_path);
+
+    if (m_path.parent_path() == fallbackDirectory()) {
+        if (mkdir(m_path.parent_path().c_str(), S_IRWXU) == -1 && errno != EEXIST) {
+            close(m_socket);
+            throw std::system_error(errno, std::system_category(), "Unable to create socket directory " + m_path.parent_path().string());
+        }
+        if (!hasPrivateDirectory(m_path)) {
+            close(m_socket);
+            throw std::logic_error("Socket directory is accessible to other users: " + m_path.parent_path().string());
+        }
+    }
+
+    // Remove socket left from the previous run, but don't take it from a running daemon
+    if (fs::is_socket(m_path)) {
+        // Non-blocking connect fails with EAGAIN if the daemon is alive but its backlog is full
+        const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        const bool connected = probe != -1 && connect(probe, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0;
+        const int error = errno;
+        const bool inUse = connected || (probe != -1 && error == EAGAIN);
+        if (probe != -1)
+            close(probe);
+        if (inUse) {
+            close(m_socket);
+            throw std::logic_error("Another daemon is already listening on " + m_path.string());
+        }
+        if (probe == -1 || (error != ECONNREFUSED && error != ENOENT)) {
+            close(m_socket);
+            throw std::system_error(error, std::system_category(), "Unable to check socket " + m_path.string());
+        }
+        fs::remove(m_path);
+    }
+
+    if (bind(m_socket, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == -1 || listen(m_socket, SOMAXCONN) == -1) {
+        close(m_socket);
+        throw std::system_error(errno, std::system_category(), "Unable to listen on " + m_path.string());
+    }
+
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    if (m_epoll == -1 || epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_socket, &event) == -1) {
+        if (m_epoll != -1)
+            close(m_epoll);
+        close(m_socket);
+        fs::remove(m_path);
+        throw std::system_error(errno, std::system_category(), "Unable to watch socket " + m_path.string());
+    }
+}
+
+Server::~Server()
+{
+    for (const auto &[clientId, client] : m_clients)
+        close(client.output.fd());
+    close(m_epoll);
+    close(m_socket);
+
+    std::error_code error;
+    fs::remove(m_path, error);
+}
+
+fs::path Server::defaultPath(const char *display)
+{
+    // Display is a part of the name to run a daemon for each seat
+    std::string name = "akd";
+    if (!display)
+        display = std::getenv("DISPLAY");
+    if (display)
+        name += display;
+    std::replace(name.begin(), name.end(), '/', '_');
+
+    if (const char *runtimeDirectory = std::getenv("XDG_RUNTIME_DIR"); runtimeDirectory)
+        return fs::path(runtimeDirectory) / (name + ".sock");
+    return fallbackDirectory() / (name + ".sock");
+}
+
+bool Server::hasPrivateDirectory(const fs::path &path)
+{
+    if (path.parent_path() != fallbackDirectory())
+        return true;
+
+    // Symlinks are not followed, the directory itself should belong to the user
+    struct stat status;
+    if (lstat(path.parent_path().c_str(), &status) == -1)
+        return false;
+    return S_ISDIR(status.st_mode) && status.st_uid == getuid() && (status.st_mode & (S_IRWXG | S_IRWXO)) == 0;
+}
+
+int Server::fd() const
+{
+    return m_epoll;
+}
+
+void Server::processEvents(std::vector<Request> &requests)
+{
+    std::array<epoll_event, 32> events;
+    int eventsCount;
+    do {
+        eventsCount = epoll_wait(m_epoll, events.data(), events.size(), 0);
+        if (eventsCount == -1) {
+            if (errno == EINTR)
+                continue;
+            throw std::system_error(errno, std::system_category(), "Unable to wait for socket events");
+        }
+
+        for (int i = 0; i < eventsCount; ++i) {
+            const uint64_t clientId = events[i].data.u64;
+            if (clientId == 0) {
+                acceptClients();
+                continue;
+            }
+
+            auto client = m_clients.find(clientId);
+            if (client == m_clients.end())
+                continue;
+
+            if (events[i].events & EPOLLOUT) {
+                try {
+                    client->second.output.flush();
+                } catch (const std::system_error &) {
+                    disconnect(clientId);
+                    continue;
+                }
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                readRequests(clientId, requests);
+        }
+    } while (eventsCount == static_cast<int>(events.size()));
+}
+
+void Server::reply(uint64_t client, std::string_view line)
+{
+    if (auto it = m_clients.find(client); it != m_clients.end())
+        send(client, it->second, line);
+}
+
+void Server::subscribe(uint64_t client)
+{
+    if (auto it = m_clients.find(client); it != m_clients.end())
+        it->second.subscribed = true;
+}
+
+void Server::publish(std::string_view line)
+{
+    // Sending could disconnect a client
+    for (auto it = m_clients.begin(); it != m_clients.end();) {
+        auto &[clientId, client] = *it++;
+        if (client.subscribed)
+            send(clientId, client, line);
+    }
+}
+
+void Server::acceptClients()
+{
+    while (true) {
+        const int fd = accept4(m_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            throw std::system_error(errno, std::system_category(), "Unable to accept client");
+        }
+
+        // Edge-triggered, so writing is resumed only when the client reads stalled data
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.u64 = m_nextClientId;
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, fd, &event) == -1) {
+            close(fd);
+            throw std::system_error(errno, std::system_category(), "Unable to watch client");
+        }
+        m_clients.try_emplace(m_nextClientId++, fd);
+    }
+}
+
+void Server::readRequests(uint64_t clientId, std::vector<Request> &requests)
+{
+    Client &client = m_clients.at(clientId);
+    std::array<char, 512> buffer;
+    while (true) {
+        const ssize_t size = read(client.output.fd(), buffer.data(), buffer.size());
+        if (size == -1 && errno == EINTR)
+            continue;
+        if (size == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (size <= 0) {
+            disconnect(clientId);
+            return;
+        }
+
+        client.input.append(buffer.data(), static_cast<size_t>(size));
+        size_t lineBegin = 0;
+        for (size_t lineEnd = client.input.find('\n'); lineEnd != std::string::npos; lineEnd = client.input.find('\n', lineBegin)) {
+            const std::string_view line(client.input.data() + lineBegin, lineEnd - lineBegin);
+            if (const std::optional<Request> request = parseRequest(clientId, line); request)
+                requests.push_back(request.value());
+            else if (!send(clientId, client, "error: unknown command"))
+                return;
+            lineBegin = lineEnd + 1;
+        }
+        client.input.erase(0, lineBegin);
+
+        if (client.input.size() > maxRequestLength) {
+            disconnect(clientId);
+            return;
+        }
+    }
+}
+
+bool Server::send(uint64_t clientId, Client &client, std::string_view line)
+{
+    try {
+        client.output.writeLine(line);
+        return true;
+    } catch (const std::system_error &) {
+        disconnect(clientId);
+        return false;
+    }
+}
+
+void Server::disconnect(uint64_t clientId)
+{
+    const auto client = m_clients.find(clientId);
+    if (client == m_clients.end())
+        return;
+
+    // Closing also removes the descriptor from epoll
+    close(client->second.output.fd());
+    m_clients.erase(client);
+}
+
+std::optional<Server::Request> Server::parseRequest(uint64_t clientId, std::string_view line)
+{
+    if (!line.empty() && line.back() == '\r')
+        line.remove_suffix(1);
+
+    if (line == "get-group")
+        return Request{clientId, Command::GetGroup};
+    if (line == "get-group-index")
+        return Request{clientId, Command::GetGroupIndex};
+    if (line == "subscribe")
+        return Request{clientId, Command::Subscribe};
+    if (line == "next-group")
+        return Request{clientId, Command::NextGroup};
+    if (line == "next-layout")
+        return Request{clientId, Command::NextLayout};
+    if (line == "previous-layout")
+        return Request{clientId, Command::PreviousLayout};
+    if (line == "stats")
+        return Request{clientId, Command::GetStatistics};
+    if (line == "dump-trace")
+        return Request{clientId, Command::DumpTrace};
+
+    constexpr std::array<std::pair<std::string_view, Command>, 2> indexedCommands{{
+        {"set-group ", Command::SetGroup},
+        {"set-layout ", Command::SetLayout},
+    }};
+    for (const auto &[name, command] : indexedCommands) {
+        if (line.substr(0, name.size()) != name)
+            continue;
+
+        uint16_t index;
+        const char *end = line.data() + line.size();
+        if (auto [indexEnd, error] = std::from_chars(line.data() + name.size(), end, index); error != std::errc() || indexEnd != end)
+            return std::nullopt;
+        return Request{clientId, command, index};
+    }
+
+    return std::nullopt;
+}
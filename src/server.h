@@ -0,0 +1,101 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "outputsink.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Unix socket server with line-based protocol for status bars and other consumers.
+// Requests are only parsed here, the daemon executes them without X round-trips.
+class Server
+{
+public:
+    enum class Command : uint8_t {
+        GetGroup,
+        GetGroupIndex,
+        Subscribe,
+        SetGroup,
+        NextGroup,
+        SetLayout,
+        NextLayout,
+        PreviousLayout,
+        GetStatistics,
+        DumpTrace,
+    };
+
+    struct Request {
+        uint64_t client;
+        Command command;
+        uint16_t index = 0; // Group or layout index for SetGroup and SetLayout
+    };
+
+    explicit Server(std::filesystem::path path);
+    Server(const Server &) = delete;
+    Server &operator=(const Server &) = delete;
+    ~Server();
+
+    // Socket for the display ($DISPLAY by default) that is also used by one-shot commands
+    [[nodiscard]] static std::filesystem::path defaultPath(const char *display = nullptr);
+    // Fallback directory in /tmp should be owned by the user and closed for others, other paths are trusted
+    [[nodiscard]] static bool hasPrivateDirectory(const std::filesystem::path &path);
+
+    // Epoll file descriptor, readable when there are new clients or requests
+    [[nodiscard]] int fd() const;
+
+    // Accepts clients and reads their requests without blocking
+    void processEvents(std::vector<Request> &requests);
+
+    void reply(uint64_t client, std::string_view line);
+    void subscribe(uint64_t client);
+    // Sends the line to all subscribed clients
+    void publish(std::string_view line);
+
+private:
+    struct Client {
+        explicit Client(int fd);
+
+        OutputSink output;
+        std::string input;
+        bool subscribed = false;
+    };
+
+    void acceptClients();
+    void readRequests(uint64_t clientId, std::vector<Request> &requests);
+    // Returns false if the client was disconnected
+    bool send(uint64_t clientId, Client &client, std::string_view line);
+    void disconnect(uint64_t clientId);
+    [[nodiscard]] static std::optional<Request> parseRequest(uint64_t clientId, std::string_view line);
+
+    std::filesystem::path m_path;
+    std::unordered_map<uint64_t, Client> m_clients;
+    uint64_t m_nextClientId = 1; // 0 is used for the listening socket
+    int m_socket;
+    int m_epoll;
+};
+
+#endif // SERVER_H
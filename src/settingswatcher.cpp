@@ -0,0 +1,70 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "settingswatcher.h"
+
+#include <array>
+#include <system_error>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+SettingsWatcher::SettingsWatcher(const std::filesystem::path &path)
+    : m_fileName(path.filename())
+    , m_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+{
+    if (m_fd == -1)
+        throw std::system_error(errno, std::system_category(), "Unable to watch settings");
+
+    if (inotify_add_watch(m_fd, path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+        const int error = errno;
+        close(m_fd);
+        throw std::system_error(error, std::system_category(), "Unable to watch settings directory " + path.parent_path().string());
+    }
+}
+
+SettingsWatcher::~SettingsWatcher()
+{
+    close(m_fd);
+}
+
+int SettingsWatcher::fd() const
+{
+    return m_fd;
+}
+
+bool SettingsWatcher::processEvents()
+{
+    bool changed = false;
+    alignas(inotify_event) std::array<char, 4096> buffer;
+    while (true) {
+        const ssize_t size = read(m_fd, buffer.data(), buffer.size());
+        if (size == -1 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            return changed;
+
+        for (ssize_t offset = 0; offset < size;) {
+            const auto *event = reinterpret_cast<const inotify_event *>(buffer.data() + offset);
+            if (event->len != 0 && event->name == m_fileName)
+                changed = true;
+            offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SETTINGSWATCHER_H
+#define SETTINGSWATCHER_H
+
+#include <filesystem>
+#include <string>
+
+// Watches the directory of the settings file because editors often replace files instead of writing them
+class SettingsWatcher
+{
+public:
+    explicit SettingsWatcher(const std::filesystem::path &path);
+    SettingsWatcher(const SettingsWatcher &) = delete;
+    SettingsWatcher &operator=(const SettingsWatcher &) = delete;
+    ~SettingsWatcher();
+
+    [[nodiscard]] int fd() const;
+    // Reads all pending events and returns true if the settings file was changed
+    [[nodiscard]] bool processEvents();
+
+private:
+    std::string m_fileName;
+    int m_fd;
+};
+
+#endif // SETTINGSWATCHER_H
@@ -19,53 +19,259 @@
 
 #include "shortcut.h"
 
-#include "keyboarddaemon.h"
+#include "layout.h"
 
 #include <boost/tokenizer.hpp>
 
-constexpr std::array<unsigned, 4> additionalModifiers = {0, Mod2Mask, LockMask, Mod2Mask | LockMask};
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <unordered_set>
 
-Shortcut::Shortcut(const std::string &shortcut, KeyboardDaemon &daemon, std::function<void(KeyboardDaemon &)> callback)
-    : m_daemon(daemon)
-    , m_callback(std::move(callback))
+#include <X11/Xproto.h>
+
+// Lock modifiers (CapsLock and NumLock) don't affect shortcuts
+constexpr unsigned relevantModifiers = ShiftMask | ControlMask | Mod1Mask | Mod4Mask;
+constexpr std::array<unsigned, 4> lockModifiers = {0, Mod2Mask, LockMask, Mod2Mask | LockMask};
+
+// XGrabKey reports keys grabbed by other applications only asynchronously with BadAccess
+static std::vector<unsigned long> failedGrabSerials;
+static XErrorHandler previousErrorHandler;
+
+static int saveGrabError(Display *display, XErrorEvent *event)
+{
+    if (event->error_code == BadAccess && event->request_code == X_GrabKey) {
+        failedGrabSerials.push_back(event->serial);
+        return 0;
+    }
+    return previousErrorHandler(display, event);
+}
+
+void ShortcutTable::add(const std::string &shortcut, Binding binding)
 {
     const boost::tokenizer keys(shortcut, boost::char_separator<char>("+"));
 
+    unsigned modmask = 0;
+    KeySym keysym = NoSymbol;
     for (auto it = keys.begin(); it != keys.end(); ++it) {
         if (it.current_token() == "Ctrl") {
-            m_modmask |= ControlMask;
+            modmask |= ControlMask;
         } else if (it.current_token() == "Alt") {
-            m_modmask |= Mod1Mask;
+            modmask |= Mod1Mask;
         } else if (it.current_token() == "Meta") {
-            m_modmask |= Mod4Mask;
+            modmask |= Mod4Mask;
         } else if (it.current_token() == "Shift") {
-            m_modmask |= ShiftMask;
+            modmask |= ShiftMask;
         } else {
-            if (m_keycode)
+            if (keysym != NoSymbol)
                 throw std::logic_error("You can't specify more then one key in shortcut: " + shortcut);
-            const KeySym keySum = XStringToKeysym(it->data());
-            if (keySum == NoSymbol)
+            keysym = XStringToKeysym(it->data());
+            if (keysym == NoSymbol)
                 throw std::logic_error("Unable to get keysum from " + it.current_token());
-            m_keycode = XKeysymToKeycode(&daemon.display(), keySum);
         }
     }
 
-    if (!m_keycode)
+    if (keysym == NoSymbol)
         throw std::logic_error("You cannot bind shortcut without keys: " + shortcut);
 
-    // Need to bind all combinations with CapsLock and ScrollLock to make it work
-    for (unsigned specialModifier : additionalModifiers) {
-        if (!XGrabKey(&daemon.display(), m_keycode.value(), m_modmask | specialModifier, daemon.root(), true, GrabModeAsync, GrabModeAsync))
-            std::logic_error("Unable to register shortcut " + shortcut);
+    m_shortcuts.push_back({shortcut, keysym, modmask, binding});
+}
+
+void ShortcutTable::addIndexed(const std::string &definition, Action action, size_t indicesCount)
+{
+    const size_t indexEnd = definition.find(' ');
+    if (indexEnd == std::string::npos)
+        throw std::logic_error("Shortcut should contain an index and a shortcut separated by space: " + definition);
+
+    size_t index;
+    auto [end, error] = std::from_chars(definition.data(), definition.data() + indexEnd, index);
+    if (error != std::errc() || end != definition.data() + indexEnd)
+        throw std::logic_error("Unable to parse index in shortcut: " + definition);
+    if (index >= indicesCount)
+        throw std::logic_error("Index is out of range in shortcut: " + definition);
+
+    add(definition.substr(indexEnd + 1), {action, static_cast<uint16_t>(index)});
+}
+
+void ShortcutTable::computeKeycodes(Layout &layout, size_t layoutIndex)
+{
+    if (m_shortcuts.empty())
+        return;
+
+    std::vector<const Shortcut *> conflicts;
+    std::vector<KeyCode> layoutKeycodes = keycodes(layout, conflicts);
+    if (!conflicts.empty())
+        throw std::logic_error("Shortcut is already used: " + conflicts.front()->text);
+
+    if (layoutIndex >= m_layoutKeycodes.size())
+        m_layoutKeycodes.resize(layoutIndex + 1);
+    m_layoutKeycodes[layoutIndex] = std::move(layoutKeycodes);
+}
+
+std::vector<std::string> ShortcutTable::grab(Display &display, Window root, size_t currentLayoutIndex, const ShortcutTable *previous)
+{
+    m_display = &display;
+    m_root = root;
+    m_currentLayoutIndex = currentLayoutIndex;
+
+    m_bindings.clear();
+    if (!m_shortcuts.empty()) {
+        const std::vector<KeyCode> &keycodes = m_layoutKeycodes[currentLayoutIndex];
+        for (size_t i = 0; i < m_shortcuts.size(); ++i) {
+            if (keycodes[i] != 0)
+                m_bindings.emplace(key(keycodes[i], m_shortcuts[i].modmask), m_shortcuts[i].binding);
+        }
     }
+
+    // Keep keys that are already grabbed
+    if (previous) {
+        for (const auto &[previousKey, binding] : previous->m_bindings) {
+            if (m_bindings.find(previousKey) == m_bindings.end())
+                ungrabKey(previousKey);
+        }
+    }
+
+    // Errors of earlier requests are handled as usual, errors of grabs are matched by request serials
+    XSync(m_display, false);
+    failedGrabSerials.clear();
+    previousErrorHandler = XSetErrorHandler(saveGrabError);
+    std::vector<std::pair<unsigned long, uint16_t>> grabSerials;
+    for (const auto &[newKey, binding] : m_bindings) {
+        if (!previous || previous->m_bindings.find(newKey) == previous->m_bindings.end()) {
+            grabSerials.emplace_back(NextRequest(m_display), newKey);
+            grabKey(newKey);
+        }
+    }
+    XSync(m_display, false);
+    XSetErrorHandler(previousErrorHandler);
+
+    std::vector<std::string> failedShortcuts;
+    for (const unsigned long serial : failedGrabSerials) {
+        const auto it = std::upper_bound(grabSerials.cbegin(), grabSerials.cend(), serial, [](unsigned long value, const std::pair<unsigned long, uint16_t> &grabSerial) {
+            return value < grabSerial.first;
+        });
+        if (it == grabSerials.cbegin())
+            continue;
+
+        // Each key is grabbed with several lock modifiers, but reported once
+        const uint16_t failedKey = std::prev(it)->second;
+        if (m_bindings.erase(failedKey) == 0)
+            continue;
+        ungrabKey(failedKey);
+        const std::vector<KeyCode> &keycodes = m_layoutKeycodes[currentLayoutIndex];
+        for (size_t i = 0; i < m_shortcuts.size(); ++i) {
+            if (keycodes[i] != 0 && key(keycodes[i], m_shortcuts[i].modmask) == failedKey)
+                failedShortcuts.push_back(m_shortcuts[i].text);
+        }
+    }
+    return failedShortcuts;
 }
 
-void Shortcut::processEvent(const XKeyEvent &event) const
+void ShortcutTable::switchLayout(Layout &layout, size_t layoutIndex)
 {
-    bool currentModifiers = std::any_of(additionalModifiers.begin(), additionalModifiers.end(), [this, &event](unsigned additionalModifier) {
-        return event.state == (m_modmask | additionalModifier);
-    });
+    if (layoutIndex == m_currentLayoutIndex || m_shortcuts.empty())
+        return;
+
+    if (layoutIndex >= m_layoutKeycodes.size())
+        m_layoutKeycodes.resize(layoutIndex + 1);
+    if (m_layoutKeycodes[layoutIndex].empty()) {
+        // Too late to refuse the settings, so only conflicting shortcuts are disabled
+        std::vector<const Shortcut *> conflicts;
+        m_layoutKeycodes[layoutIndex] = keycodes(layout, conflicts);
+        for (const Shortcut *shortcut : conflicts)
+            std::cerr << "Shortcut is already used and will be disabled for layout " << layoutIndex + 1 << ": " << shortcut->text << std::endl;
+    }
 
-    if (currentModifiers && event.keycode == m_keycode)
-        m_callback(m_daemon);
+    regrab(m_layoutKeycodes[m_currentLayoutIndex], m_layoutKeycodes[layoutIndex]);
+    m_currentLayoutIndex = layoutIndex;
+}
+
+void ShortcutTable::refreshLayout(Layout &layout, size_t layoutIndex)
+{
+    if (m_shortcuts.empty())
+        return;
+
+    // Keycodes of layouts that weren't used yet will be computed on switch
+    if (layoutIndex >= m_layoutKeycodes.size() || m_layoutKeycodes[layoutIndex].empty())
+        return;
+
+    std::vector<const Shortcut *> conflicts;
+    std::vector<KeyCode> newKeycodes = keycodes(layout, conflicts);
+    for (const Shortcut *shortcut : conflicts)
+        std::cerr << "Shortcut is already used and will be disabled for layout " << layoutIndex + 1 << ": " << shortcut->text << std::endl;
+    if (layoutIndex == m_currentLayoutIndex)
+        regrab(m_layoutKeycodes[layoutIndex], newKeycodes);
+    m_layoutKeycodes[layoutIndex] = std::move(newKeycodes);
+}
+
+const ShortcutTable::Binding *ShortcutTable::find(const XKeyEvent &event) const
+{
+    const auto it = m_bindings.find(key(event.keycode, event.state));
+    if (it == m_bindings.end())
+        return nullptr;
+    return &it->second;
+}
+
+bool ShortcutTable::empty() const
+{
+    return m_shortcuts.empty();
+}
+
+std::vector<KeyCode> ShortcutTable::keycodes(Layout &layout, std::vector<const Shortcut *> &conflicts) const
+{
+    std::vector<KeyCode> keycodes;
+    keycodes.reserve(m_shortcuts.size());
+    std::unordered_set<uint16_t> keys;
+    for (const Shortcut &shortcut : m_shortcuts) {
+        KeyCode keycode = layout.keycode(shortcut.keysym);
+        if (keycode != 0 && !keys.insert(key(keycode, shortcut.modmask)).second) {
+            conflicts.push_back(&shortcut);
+            keycode = 0;
+        }
+        keycodes.push_back(keycode);
+    }
+    return keycodes;
+}
+
+void ShortcutTable::regrab(const std::vector<KeyCode> &oldKeycodes, const std::vector<KeyCode> &newKeycodes)
+{
+    // Release all changed keys first, a shortcut could move to a key released by another one
+    for (size_t i = 0; i < m_shortcuts.size(); ++i) {
+        if (oldKeycodes[i] != newKeycodes[i] && oldKeycodes[i] != 0) {
+            const uint16_t oldKey = key(oldKeycodes[i], m_shortcuts[i].modmask);
+            m_bindings.erase(oldKey);
+            ungrabKey(oldKey);
+        }
+    }
+    for (size_t i = 0; i < m_shortcuts.size(); ++i) {
+        if (oldKeycodes[i] != newKeycodes[i] && newKeycodes[i] != 0) {
+            const uint16_t newKey = key(newKeycodes[i], m_shortcuts[i].modmask);
+            m_bindings.emplace(newKey, m_shortcuts[i].binding);
+            grabKey(newKey);
+        }
+    }
+}
+
+void ShortcutTable::grabKey(uint16_t key) const
+{
+    // Need to bind all combinations with CapsLock and NumLock to make it work,
+    // keys grabbed by other applications are reported asynchronously
+    for (unsigned lockModifier : lockModifiers) {
+        XGrabKey(m_display, key >> 8, (key & 0xFF) | lockModifier, m_root, true, GrabModeAsync, GrabModeAsync);
+    }
+}
+
+void ShortcutTable::ungrabKey(uint16_t key) const
+{
+    for (unsigned lockModifier : lockModifiers)
+        XUngrabKey(m_display, key >> 8, (key & 0xFF) | lockModifier, m_root);
+}
+
+uint16_t ShortcutTable::key(unsigned keycode, unsigned modmask)
+{
+    // Keycodes and core modifiers fit into a byte
+    return static_cast<uint16_t>((keycode & 0xFF) << 8 | (modmask & relevantModifiers));
 }
@@ -20,27 +20,75 @@
 #ifndef SHORTCUT_H
 #define SHORTCUT_H
 
-#include <functional>
-#include <optional>
+#include <cstdint>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <X11/Xlib.h>
 
-class KeyboardDaemon;
+class Layout;
 
-class Shortcut
+// Shortcuts indexed by keycode and modifiers, so a key press is dispatched with a single lookup.
+// The same key symbol could be placed on different keys in different layouts, so keycodes are computed for each layout.
+// Layout keymaps are expensive to build, so keycodes of other layouts are computed on the first switch to them.
+class ShortcutTable
 {
 public:
-    Shortcut(const std::string &shortcut, KeyboardDaemon &daemon, std::function<void(KeyboardDaemon &)> callback);
+    enum class Action : uint8_t {
+        NextLayout,
+        PreviousLayout,
+        LastLayout,
+        SetGroup,
+        SetLayout,
+        NextGroup, // Only for socket requests
+    };
 
-    void processEvent(const XKeyEvent &event) const;
+    struct Binding {
+        Action action;
+        uint16_t index = 0; // Group or layout index for SetGroup and SetLayout
+    };
+
+    void add(const std::string &shortcut, Binding binding);
+    // Parses "<index> <shortcut>" and checks that the index is less than indicesCount
+    void addIndexed(const std::string &definition, Action action, size_t indicesCount);
+
+    // Computes keycodes for the layout and throws if shortcuts conflict, doesn't modify grabs
+    void computeKeycodes(Layout &layout, size_t layoutIndex);
+    // Grabs keys for the current layout, its keycodes should be computed
+    // Only keys that differ from the previous table are grabbed and released.
+    // Returns shortcuts whose keys are grabbed by other applications, they are disabled
+    [[nodiscard]] std::vector<std::string> grab(Display &display, Window root, size_t currentLayoutIndex, const ShortcutTable *previous = nullptr);
+    // Moves only grabs with different keycodes, conflicting shortcuts are reported and disabled for the layout
+    void switchLayout(Layout &layout, size_t layoutIndex);
+    void refreshLayout(Layout &layout, size_t layoutIndex);
+
+    [[nodiscard]] const Binding *find(const XKeyEvent &event) const;
+    [[nodiscard]] bool empty() const;
 
 private:
-    unsigned m_modmask = 0;
-    std::optional<KeyCode> m_keycode;
+    struct Shortcut {
+        std::string text;
+        KeySym keysym;
+        unsigned modmask;
+        Binding binding;
+    };
+
+    // Shortcuts that use already taken keys get zero keycodes and are added to conflicts
+    [[nodiscard]] std::vector<KeyCode> keycodes(Layout &layout, std::vector<const Shortcut *> &conflicts) const;
+    void regrab(const std::vector<KeyCode> &oldKeycodes, const std::vector<KeyCode> &newKeycodes);
+    void grabKey(uint16_t key) const;
+    void ungrabKey(uint16_t key) const;
+
+    [[nodiscard]] static uint16_t key(unsigned keycode, unsigned modmask);
+
+    std::vector<Shortcut> m_shortcuts;
+    std::vector<std::vector<KeyCode>> m_layoutKeycodes; // Keycode for each shortcut in each layout, 0 if key symbol is absent, empty if not computed yet
+    std::unordered_map<uint16_t, Binding> m_bindings;
+    size_t m_currentLayoutIndex = 0;
 
-    KeyboardDaemon &m_daemon;
-    std::function<void(KeyboardDaemon &)> m_callback;
+    Display *m_display = nullptr;
+    Window m_root = None;
 };
 
 #endif // SHORTCUT_H
@@ -0,0 +1,174 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "statefile.h"
+
+#include <algorithm>
+#include <array>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct Header {
+    std::array<char, 4> magic;
+    uint32_t version;
+    uint32_t layoutsHash;
+};
+
+struct WindowRecord {
+    uint32_t key; // Window ID
+    uint32_t classHash;
+    Keyboard keyboard;
+};
+
+struct ClassRecord {
+    uint32_t key; // Class hash
+    Keyboard keyboard;
+};
+
+static constexpr std::array<char, 4> magic = {'A', 'K', 'D', 'S'};
+static constexpr uint32_t version = 1;
+
+static constexpr size_t windowsCapacity = 4096;
+static constexpr size_t classesCapacity = 1024;
+static constexpr size_t windowsOffset = sizeof(Header);
+static constexpr size_t classesOffset = windowsOffset + windowsCapacity * sizeof(WindowRecord);
+static constexpr size_t fileSize = classesOffset + classesCapacity * sizeof(ClassRecord);
+
+// Tables are set-associative: a record can be placed only in one of the slots starting from its home slot
+static constexpr size_t associativity = 8;
+
+template<typename Record, size_t Capacity>
+static Record *findRecord(char *data, size_t offset, uint32_t key)
+{
+    auto *records = reinterpret_cast<Record *>(data + offset);
+    for (size_t i = 0; i < associativity; ++i) {
+        if (Record &record = records[(key + i) % Capacity]; record.key == key)
+            return &record;
+    }
+    return nullptr;
+}
+
+template<typename Record, size_t Capacity>
+static Record &recordToWrite(char *data, size_t offset, uint32_t key)
+{
+    if (Record *record = findRecord<Record, Capacity>(data, offset, key); record)
+        return *record;
+
+    // Use a free slot or replace the record in the home slot
+    auto *records = reinterpret_cast<Record *>(data + offset);
+    for (size_t i = 0; i < associativity; ++i) {
+        if (Record &record = records[(key + i) % Capacity]; record.key == 0)
+            return record;
+    }
+    return records[key % Capacity];
+}
+
+StateFile::StateFile(const std::filesystem::path &path, uint32_t layoutsHash)
+    : m_fd(open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR))
+{
+    if (m_fd == -1)
+        throw std::system_error(errno, std::system_category(), "Unable to open state file " + path.string());
+
+    struct stat fileStat;
+    if (fstat(m_fd, &fileStat) == -1) {
+        close(m_fd);
+        throw std::system_error(errno, std::system_category(), "Unable to read state file " + path.string());
+    }
+
+    // Truncate file with unexpected size to fill it with zeroes
+    const bool sizeMatches = static_cast<size_t>(fileStat.st_size) == fileSize;
+    if (!sizeMatches && (ftruncate(m_fd, 0) == -1 || ftruncate(m_fd, fileSize) == -1)) {
+        close(m_fd);
+        throw std::system_error(errno, std::system_category(), "Unable to resize state file " + path.string());
+    }
+
+    void *data = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (data == MAP_FAILED) {
+        close(m_fd);
+        throw std::system_error(errno, std::system_category(), "Unable to map state file " + path.string());
+    }
+    m_data = static_cast<char *>(data);
+
+    // Only header is validated, records are read on demand
+    auto *header = reinterpret_cast<Header *>(m_data);
+    if (header->magic == magic && header->version == version && header->layoutsHash == layoutsHash)
+        return;
+
+    if (sizeMatches)
+        std::fill_n(m_data, fileSize, 0);
+    *header = {magic, version, layoutsHash};
+}
+
+StateFile::~StateFile()
+{
+    munmap(m_data, fileSize);
+    close(m_fd);
+}
+
+std::optional<Keyboard> StateFile::windowState(Window window, uint32_t classHash) const
+{
+    // Window IDs could be reused after session restart, so check the class too
+    const auto *record = findRecord<WindowRecord, windowsCapacity>(m_data, windowsOffset, static_cast<uint32_t>(window));
+    if (record && record->classHash == classHash)
+        return record->keyboard;
+    return std::nullopt;
+}
+
+std::optional<Keyboard> StateFile::classState(uint32_t classHash) const
+{
+    if (const auto *record = findRecord<ClassRecord, classesCapacity>(m_data, classesOffset, classHash); record)
+        return record->keyboard;
+    return std::nullopt;
+}
+
+void StateFile::saveWindow(Window window, uint32_t classHash, Keyboard keyboard)
+{
+    const auto key = static_cast<uint32_t>(window);
+    recordToWrite<WindowRecord, windowsCapacity>(m_data, windowsOffset, key) = {key, classHash, keyboard};
+    recordToWrite<ClassRecord, classesCapacity>(m_data, classesOffset, classHash) = {classHash, keyboard};
+}
+
+void StateFile::updateWindow(Window window, Keyboard keyboard)
+{
+    if (auto *record = findRecord<WindowRecord, windowsCapacity>(m_data, windowsOffset, static_cast<uint32_t>(window)); record) {
+        record->keyboard = keyboard;
+        recordToWrite<ClassRecord, classesCapacity>(m_data, classesOffset, record->classHash) = {record->classHash, keyboard};
+    }
+}
+
+void StateFile::eraseWindow(Window window)
+{
+    if (auto *record = findRecord<WindowRecord, windowsCapacity>(m_data, windowsOffset, static_cast<uint32_t>(window)); record)
+        *record = {};
+}
+
+uint32_t StateFile::hash(std::string_view string)
+{
+    // FNV-1a, never returns zero which marks free records
+    uint32_t hash = 2166136261;
+    for (const char character : string) {
+        hash ^= static_cast<unsigned char>(character);
+        hash *= 16777619;
+    }
+    return hash != 0 ? hash : 1;
+}
@@ -0,0 +1,57 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATEFILE_H
+#define STATEFILE_H
+
+#include "keyboard.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string_view>
+
+#include <X11/X.h>
+
+// Memory-mapped file with keyboard state of windows and window classes to restore it after restart.
+// Records are written directly into the mapping, so the file is always up to date.
+class StateFile
+{
+public:
+    // The file will be reset if it was written for different layouts
+    StateFile(const std::filesystem::path &path, uint32_t layoutsHash);
+    StateFile(const StateFile &) = delete;
+    StateFile &operator=(const StateFile &) = delete;
+    ~StateFile();
+
+    [[nodiscard]] std::optional<Keyboard> windowState(Window window, uint32_t classHash) const;
+    [[nodiscard]] std::optional<Keyboard> classState(uint32_t classHash) const;
+
+    void saveWindow(Window window, uint32_t classHash, Keyboard keyboard);
+    void updateWindow(Window window, Keyboard keyboard);
+    void eraseWindow(Window window);
+
+    [[nodiscard]] static uint32_t hash(std::string_view string);
+
+private:
+    int m_fd;
+    char *m_data;
+};
+
+#endif // STATEFILE_H
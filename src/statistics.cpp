@@ -0,0 +1,121 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "statistics.h"
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+// Microseconds are easier to read, but nanoseconds are kept for accuracy
+static double microseconds(std::chrono::nanoseconds duration)
+{
+    return static_cast<double>(duration.count()) / 1000.0;
+}
+
+void LatencyHistogram::record(std::chrono::nanoseconds latency)
+{
+    const auto ns = static_cast<uint64_t>(std::max<std::chrono::nanoseconds::rep>(latency.count(), 0));
+    const size_t bucket = ns == 0 ? 0 : std::min<size_t>(64 - static_cast<size_t>(__builtin_clzll(ns)), bucketsCount - 1);
+    ++m_buckets[bucket];
+    ++m_count;
+    m_totalNs += ns;
+    m_maxNs = std::max(m_maxNs, ns);
+}
+
+uint64_t LatencyHistogram::count() const
+{
+    return m_count;
+}
+
+std::chrono::nanoseconds LatencyHistogram::mean() const
+{
+    if (m_count == 0)
+        return {};
+    return std::chrono::nanoseconds(m_totalNs / m_count);
+}
+
+std::chrono::nanoseconds LatencyHistogram::max() const
+{
+    return std::chrono::nanoseconds(m_maxNs);
+}
+
+std::chrono::nanoseconds LatencyHistogram::percentile(double fraction) const
+{
+    const auto target = static_cast<uint64_t>(std::ceil(fraction * static_cast<double>(m_count)));
+    uint64_t accumulated = 0;
+    for (size_t bucket = 0; bucket < bucketsCount; ++bucket) {
+        accumulated += m_buckets[bucket];
+        if (accumulated >= target && accumulated != 0)
+            return std::chrono::nanoseconds(std::min(uint64_t(1) << bucket, m_maxNs));
+    }
+    return max();
+}
+
+Statistics::Timer::Timer(Statistics &statistics, Handler handler)
+    : m_statistics(statistics)
+    , m_start(std::chrono::steady_clock::now())
+    , m_handler(handler)
+{
+}
+
+Statistics::Timer::~Timer()
+{
+    m_statistics.record(m_handler, std::chrono::steady_clock::now() - m_start);
+}
+
+void Statistics::record(Handler handler, std::chrono::nanoseconds latency)
+{
+    m_histograms[static_cast<size_t>(handler)].record(latency);
+}
+
+std::string Statistics::text(const Counters &counters) const
+{
+    std::string text = (boost::format("%-16s %10s %12s %12s %12s %12s\n") % "handler" % "count" % "mean, us" % "p50, us" % "p99, us" % "max, us").str();
+    for (size_t i = 0; i < handlersCount; ++i) {
+        const LatencyHistogram &histogram = m_histograms[i];
+        text += (boost::format("%-16s %10d %12.1f %12.1f %12.1f %12.1f\n") % handlerNames[i] % histogram.count() % microseconds(histogram.mean())
+                    % microseconds(histogram.percentile(0.5)) % microseconds(histogram.percentile(0.99)) % microseconds(histogram.max()))
+                    .str();
+    }
+
+    text += (boost::format("events: %d\nx-replies: %d\nwindows: %d\nskipped-focus-changes: %d\nstale-windows-removed: %d\ndropped-lines: %d\n")
+                % counters.events % counters.replies % counters.windows % counters.skippedFocusChanges % counters.staleWindowsRemoved % counters.droppedLines)
+                .str();
+    return text;
+}
+
+std::string Statistics::json(const Counters &counters) const
+{
+    std::string json = "{\"handlers\":{";
+    for (size_t i = 0; i < handlersCount; ++i) {
+        const LatencyHistogram &histogram = m_histograms[i];
+        if (i != 0)
+            json += ',';
+        json += (boost::format("\"%s\":{\"count\":%d,\"mean_us\":%.3f,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}") % handlerNames[i] % histogram.count() % microseconds(histogram.mean())
+                    % microseconds(histogram.percentile(0.5)) % microseconds(histogram.percentile(0.99)) % microseconds(histogram.max()))
+                    .str();
+    }
+
+    json += (boost::format("},\"counters\":{\"events\":%d,\"x_replies\":%d,\"windows\":%d,\"skipped_focus_changes\":%d,\"stale_windows_removed\":%d,\"dropped_lines\":%d}}")
+                % counters.events % counters.replies % counters.windows % counters.skippedFocusChanges % counters.staleWindowsRemoved % counters.droppedLines)
+                .str();
+    return json;
+}
@@ -0,0 +1,100 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Latency histogram with power of two buckets, recording never allocates
+class LatencyHistogram
+{
+public:
+    void record(std::chrono::nanoseconds latency);
+
+    [[nodiscard]] uint64_t count() const;
+    [[nodiscard]] std::chrono::nanoseconds mean() const;
+    [[nodiscard]] std::chrono::nanoseconds max() const;
+    // Upper bound of the bucket that contains the specified fraction of samples
+    [[nodiscard]] std::chrono::nanoseconds percentile(double fraction) const;
+
+private:
+    // Bucket i contains latencies below 2^i ns, the last one is about 9 minutes
+    static constexpr size_t bucketsCount = 40;
+
+    std::array<uint64_t, bucketsCount> m_buckets{};
+    uint64_t m_count = 0;
+    uint64_t m_totalNs = 0;
+    uint64_t m_maxNs = 0;
+};
+
+// Latencies of event handlers and daemon counters, dumped as text or JSON
+class Statistics
+{
+public:
+    enum class Handler : uint8_t {
+        FocusChange,
+        WindowDestroy,
+        Shortcut,
+        GroupChange,
+        Request,
+        LayoutApply,
+    };
+
+    struct Counters {
+        uint64_t events;
+        uint64_t replies;
+        size_t windows;
+        size_t skippedFocusChanges;
+        size_t staleWindowsRemoved;
+        size_t droppedLines;
+    };
+
+    // Records the time until the end of the scope
+    class Timer
+    {
+    public:
+        Timer(Statistics &statistics, Handler handler);
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+        ~Timer();
+
+    private:
+        Statistics &m_statistics;
+        std::chrono::steady_clock::time_point m_start;
+        Handler m_handler;
+    };
+
+    void record(Handler handler, std::chrono::nanoseconds latency);
+
+    [[nodiscard]] std::string text(const Counters &counters) const;
+    // Single line, so it can be sent as a socket reply
+    [[nodiscard]] std::string json(const Counters &counters) const;
+
+private:
+    static constexpr size_t handlersCount = static_cast<size_t>(Handler::LayoutApply) + 1;
+    static constexpr std::array<const char *, handlersCount> handlerNames = {"focus-change", "window-destroy", "shortcut", "group-change", "request", "layout-apply"};
+
+    std::array<LatencyHistogram, handlersCount> m_histograms;
+};
+
+#endif // STATISTICS_H
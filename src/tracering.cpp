@@ -0,0 +1,134 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "tracering.h"
+
+#include <boost/format.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+
+#include <unistd.h>
+
+static constexpr uint32_t instantDuration = std::numeric_limits<uint32_t>::max();
+
+struct EventDescription {
+    const char *name;
+    const char *valueName; // Omitted from arguments if null
+};
+
+static constexpr std::array<EventDescription, static_cast<size_t>(TraceRing::Event::Request) + 1> eventDescriptions = {{
+    {"focus-change", nullptr},
+    {"skipped-focus-change", nullptr},
+    {"DestroyNotify", nullptr},
+    {"KeyPress", "keycode"},
+    {"MappingNotify", nullptr},
+    {"XkbStateNotify", "group"},
+    {"set-layout", "layout"},
+    {"set-group", "group"},
+    {"layout-apply", "layout"},
+    {"XkbLockGroup", "group"},
+    {"ignored-group-save", "group"},
+    {"request", "command"},
+}};
+
+TraceRing::Span::Span(std::optional<TraceRing> &ring, Event event, Window window, uint16_t value)
+    : m_ring(ring ? &ring.value() : nullptr)
+    , m_window(window)
+    , m_value(value)
+    , m_event(event)
+{
+    if (m_ring)
+        m_start = std::chrono::steady_clock::now();
+}
+
+TraceRing::Span::~Span()
+{
+    if (!m_ring)
+        return;
+
+    const auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+    m_ring->record(m_start, static_cast<uint32_t>(std::min<decltype(duration)>(duration, instantDuration - 1)), m_event, m_window, m_value);
+}
+
+void TraceRing::Span::setWindow(Window window)
+{
+    m_window = window;
+}
+
+TraceRing::TraceRing(size_t capacity)
+    : m_records(capacity)
+    , m_startTime(std::chrono::steady_clock::now())
+{
+    if (capacity == 0)
+        throw std::logic_error("Trace ring capacity can't be zero");
+}
+
+void TraceRing::instant(Event event, Window window, uint16_t value)
+{
+    record(std::chrono::steady_clock::now(), instantDuration, event, window, value);
+}
+
+void TraceRing::save(const std::filesystem::path &path) const
+{
+    std::ofstream file(path, std::ios::trunc);
+    if (!file)
+        throw std::system_error(errno, std::system_category(), "Unable to open " + path.string());
+
+    // Complete events ("X") are used for spans and thread-scoped instant events ("i") for the rest
+    const pid_t pid = getpid();
+    file << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    const size_t count = m_wrapped ? m_records.size() : m_next;
+    const size_t first = m_wrapped ? m_next : 0;
+    for (size_t i = 0; i < count; ++i) {
+        const Record &record = m_records[(first + i) % m_records.size()];
+        const EventDescription &description = eventDescriptions[static_cast<size_t>(record.event)];
+        if (i != 0)
+            file << ',';
+        file << boost::format("\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,") % description.name % pid % pid % (static_cast<double>(record.start) / 1000.0);
+        if (record.duration == instantDuration)
+            file << "\"ph\":\"i\",\"s\":\"t\"";
+        else
+            file << boost::format("\"ph\":\"X\",\"dur\":%.3f") % (static_cast<double>(record.duration) / 1000.0);
+        file << boost::format(",\"args\":{\"window\":\"0x%x\"") % record.window;
+        if (description.valueName)
+            file << boost::format(",\"%s\":%d") % description.valueName % record.value;
+        file << "}}";
+    }
+    file << "\n]}\n";
+
+    file.close();
+    if (!file)
+        throw std::system_error(errno, std::system_category(), "Unable to write " + path.string());
+}
+
+void TraceRing::record(std::chrono::steady_clock::time_point start, uint32_t duration, Event event, Window window, uint16_t value)
+{
+    const auto startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(start - m_startTime).count();
+    m_records[m_next] = {static_cast<uint64_t>(startNs), duration, static_cast<uint32_t>(window), value, event};
+    if (++m_next == m_records.size()) {
+        m_next = 0;
+        m_wrapped = true;
+    }
+}
@@ -0,0 +1,95 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACERING_H
+#define TRACERING_H
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include <X11/X.h>
+
+// Fixed-size ring of timestamped daemon events that can be exported in Chrome trace format (loads in Perfetto).
+// Records are preallocated and overwritten when the ring is full, so recording never allocates.
+class TraceRing
+{
+public:
+    enum class Event : uint8_t {
+        FocusChange,
+        SkippedFocusChange,
+        WindowDestroy,
+        ShortcutKey,
+        KeymapChange,
+        GroupChange,
+        SetLayout,
+        SetGroup,
+        LayoutApply,
+        LockGroup,
+        IgnoredGroupSave,
+        Request,
+    };
+
+    // Records the duration until the end of the scope, does nothing if tracing is disabled
+    class Span
+    {
+    public:
+        Span(std::optional<TraceRing> &ring, Event event, Window window = None, uint16_t value = 0);
+        Span(const Span &) = delete;
+        Span &operator=(const Span &) = delete;
+        ~Span();
+
+        void setWindow(Window window);
+
+    private:
+        TraceRing *m_ring;
+        std::chrono::steady_clock::time_point m_start;
+        Window m_window;
+        uint16_t m_value;
+        Event m_event;
+    };
+
+    explicit TraceRing(size_t capacity);
+
+    // Records an event without duration
+    void instant(Event event, Window window = None, uint16_t value = 0);
+
+    // Writes recorded events from the oldest to the newest
+    void save(const std::filesystem::path &path) const;
+
+private:
+    struct Record {
+        uint64_t start; // Nanoseconds since ring creation
+        uint32_t duration; // Nanoseconds, UINT32_MAX for instant events
+        uint32_t window;
+        uint16_t value; // Layout index, group, keycode or request command
+        Event event;
+    };
+
+    void record(std::chrono::steady_clock::time_point start, uint32_t duration, Event event, Window window, uint16_t value);
+
+    std::vector<Record> m_records;
+    std::chrono::steady_clock::time_point m_startTime;
+    size_t m_next = 0;
+    bool m_wrapped = false;
+};
+
+#endif // TRACERING_H
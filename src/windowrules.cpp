@@ -0,0 +1,166 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "windowrules.h"
+
+#include <charconv>
+#include <stdexcept>
+
+#include <X11/extensions/XKB.h>
+
+WindowRules::WindowRules(const std::vector<std::string> &classRules, const std::vector<std::string> &roleRules, const std::vector<std::string> &titleRules, size_t layoutsCount)
+{
+    compile(classRules, layoutsCount, &m_exactClassRules, m_classRules);
+    compile(roleRules, layoutsCount, nullptr, m_roleRules);
+    compile(titleRules, layoutsCount, nullptr, m_titleRules);
+}
+
+std::optional<WindowRules::Target> WindowRules::match(const std::string &windowClass, std::string_view role, std::string_view title)
+{
+    if (std::optional<Target> target = matchRules(m_roleRules, role); target)
+        return target;
+
+    if (std::optional<Target> target = matchRules(m_titleRules, title); target)
+        return target;
+
+    if (hasRoleRules() || hasTitleRules())
+        return matchClass(windowClass);
+
+    const auto [cachedTarget, inserted] = m_classCache.try_emplace(windowClass);
+    if (inserted)
+        cachedTarget->second = matchClass(windowClass);
+    return cachedTarget->second;
+}
+
+bool WindowRules::empty() const
+{
+    return m_exactClassRules.empty() && m_classRules.empty() && !hasRoleRules() && !hasTitleRules();
+}
+
+bool WindowRules::hasRoleRules() const
+{
+    return !m_roleRules.empty();
+}
+
+bool WindowRules::hasTitleRules() const
+{
+    return !m_titleRules.empty();
+}
+
+WindowRules::Pattern::Pattern(std::string_view pattern)
+    : m_anyPrefix(!pattern.empty() && pattern.front() == '*')
+    , m_anySuffix(!pattern.empty() && pattern.back() == '*')
+{
+    for (size_t start = 0; start < pattern.size();) {
+        size_t end = pattern.find('*', start);
+        if (end == std::string_view::npos)
+            end = pattern.size();
+        if (end != start)
+            m_parts.emplace_back(pattern.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+bool WindowRules::Pattern::matches(std::string_view string) const
+{
+    if (m_parts.empty())
+        return m_anyPrefix || string.empty();
+
+    // Without wildcards on the edges the first and the last parts should be anchored
+    if (!m_anyPrefix && string.substr(0, m_parts.front().size()) != m_parts.front())
+        return false;
+    if (!m_anySuffix && (string.size() < m_parts.back().size() || string.substr(string.size() - m_parts.back().size()) != m_parts.back()))
+        return false;
+    if (m_parts.size() == 1 && !m_anyPrefix && !m_anySuffix)
+        return string.size() == m_parts.front().size();
+
+    // Find other parts in order between the anchored ones
+    size_t position = m_anyPrefix ? 0 : m_parts.front().size();
+    const size_t end = m_anySuffix ? string.size() : string.size() - m_parts.back().size();
+    for (auto part = m_parts.begin() + (m_anyPrefix ? 0 : 1); part != m_parts.end() - (m_anySuffix ? 0 : 1); ++part) {
+        position = string.find(*part, position);
+        if (position == std::string_view::npos || position + part->size() > end)
+            return false;
+        position += part->size();
+    }
+    return position <= end;
+}
+
+std::optional<WindowRules::Target> WindowRules::matchClass(const std::string &windowClass) const
+{
+    const size_t instanceEnd = windowClass.find('\0');
+    const std::string_view instance(windowClass.data(), std::min(instanceEnd, windowClass.size()));
+    const std::string_view className = instanceEnd < windowClass.size() ? std::string_view(windowClass.c_str() + instanceEnd + 1) : std::string_view();
+
+    for (const std::string_view name : {instance, className}) {
+        if (auto it = m_exactClassRules.find(std::string(name)); it != m_exactClassRules.end())
+            return it->second;
+    }
+
+    for (const std::string_view name : {instance, className}) {
+        if (std::optional<Target> target = matchRules(m_classRules, name); target)
+            return target;
+    }
+
+    return std::nullopt;
+}
+
+std::optional<WindowRules::Target> WindowRules::matchRules(const std::vector<Rule> &rules, std::string_view string)
+{
+    for (const Rule &rule : rules) {
+        if (rule.pattern.matches(string))
+            return rule.target;
+    }
+    return std::nullopt;
+}
+
+void WindowRules::compile(const std::vector<std::string> &rules, size_t layoutsCount, std::unordered_map<std::string, Target> *exactRules, std::vector<Rule> &patternRules)
+{
+    for (const std::string &rule : rules) {
+        const size_t targetEnd = rule.find(' ');
+        if (targetEnd == std::string::npos)
+            throw std::logic_error("Rule should contain a group and a pattern separated by space: " + rule);
+
+        // Parse "<group>[:<layout>]"
+        unsigned group;
+        const char *targetBegin = rule.data();
+        auto [groupEnd, groupError] = std::from_chars(targetBegin, targetBegin + targetEnd, group);
+        if (groupError != std::errc())
+            throw std::logic_error("Unable to parse group index in rule: " + rule);
+        if (group >= XkbNumKbdGroups)
+            throw std::logic_error("Group index is out of range in rule: " + rule);
+
+        Target target{static_cast<unsigned char>(group), std::nullopt};
+        if (groupEnd != targetBegin + targetEnd) {
+            unsigned layoutIndex;
+            auto [layoutEnd, layoutError] = std::from_chars(groupEnd + 1, targetBegin + targetEnd, layoutIndex);
+            if (*groupEnd != ':' || layoutError != std::errc() || layoutEnd != targetBegin + targetEnd)
+                throw std::logic_error("Unable to parse layout index in rule: " + rule);
+            if (layoutIndex >= layoutsCount)
+                throw std::logic_error("Layout index is out of range in rule: " + rule);
+            target.layoutIndex = static_cast<uint16_t>(layoutIndex);
+        }
+
+        const std::string_view pattern = std::string_view(rule).substr(targetEnd + 1);
+        if (exactRules && pattern.find('*') == std::string_view::npos)
+            exactRules->try_emplace(std::string(pattern), target);
+        else
+            patternRules.push_back({Pattern(pattern), target});
+    }
+}
@@ -0,0 +1,82 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WINDOWRULES_H
+#define WINDOWRULES_H
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Initial group and layout for new windows, compiled from "<group>[:<layout>] <pattern>" strings
+class WindowRules
+{
+public:
+    struct Target {
+        unsigned char group;
+        std::optional<uint16_t> layoutIndex;
+    };
+
+    WindowRules() = default;
+    WindowRules(const std::vector<std::string> &classRules, const std::vector<std::string> &roleRules, const std::vector<std::string> &titleRules, size_t layoutsCount);
+
+    // Class is the value of WM_CLASS property: null-separated instance and class names
+    [[nodiscard]] std::optional<Target> match(const std::string &windowClass, std::string_view role, std::string_view title);
+
+    [[nodiscard]] bool empty() const;
+    [[nodiscard]] bool hasRoleRules() const;
+    [[nodiscard]] bool hasTitleRules() const;
+
+private:
+    // Pattern with '*' wildcards split into literal parts
+    class Pattern
+    {
+    public:
+        explicit Pattern(std::string_view pattern);
+
+        [[nodiscard]] bool matches(std::string_view string) const;
+
+    private:
+        std::vector<std::string> m_parts;
+        bool m_anyPrefix;
+        bool m_anySuffix;
+    };
+
+    struct Rule {
+        Pattern pattern;
+        Target target;
+    };
+
+    [[nodiscard]] std::optional<Target> matchClass(const std::string &windowClass) const;
+    [[nodiscard]] static std::optional<Target> matchRules(const std::vector<Rule> &rules, std::string_view string);
+    static void compile(const std::vector<std::string> &rules, size_t layoutsCount, std::unordered_map<std::string, Target> *exactRules, std::vector<Rule> &patternRules);
+
+    std::unordered_map<std::string, Target> m_exactClassRules;
+    std::vector<Rule> m_classRules;
+    std::vector<Rule> m_roleRules;
+    std::vector<Rule> m_titleRules;
+
+    // Results by window class, used only if results depend only on class
+    std::unordered_map<std::string, std::optional<Target>> m_classCache;
+};
+
+#endif // WINDOWRULES_H
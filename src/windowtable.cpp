@@ -0,0 +1,203 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "windowtable.h"
+
+#include <stdexcept>
+
+static constexpr size_t minCapacity = 16;
+
+// Keeps log2(capacity) high bits of a 32-bit hash
+static unsigned hashShift(size_t capacity)
+{
+    unsigned shift = 32;
+    for (; capacity > 1; capacity >>= 1)
+        --shift;
+    return shift;
+}
+
+Window WindowTable::Handle::window() const
+{
+    return m_window;
+}
+
+WindowTable::Handle::Handle(Window window, size_t slot)
+    : m_window(window)
+    , m_slot(slot)
+{
+}
+
+WindowTable::WindowTable(size_t maxSize)
+    : m_maxSize(maxSize)
+{
+    // The last accessed window is never evicted
+    if (maxSize == 1)
+        throw std::logic_error("Unable to limit the number of windows to one");
+
+    // Allocate all memory at once for bounded table to avoid rehashing
+    size_t capacity = minCapacity;
+    while (capacity * 3 / 4 < maxSize)
+        capacity *= 2;
+    m_slots.resize(capacity);
+    m_hashShift = hashShift(capacity);
+}
+
+std::pair<WindowTable::Handle, bool> WindowTable::tryEmplace(Window window)
+{
+    // None marks empty slots
+    if (window == None)
+        throw std::logic_error("Unable to track window None");
+
+    const auto key = static_cast<uint32_t>(window);
+    if (const size_t slot = find(key); slot != m_slots.size()) {
+        m_slots[slot].window |= referencedBit;
+        m_lastAccessed = key;
+        return {Handle(window, slot), false};
+    }
+
+    // Evict before updating the last accessed window to keep it
+    if (m_maxSize != 0 && m_size == m_maxSize)
+        evict();
+    else if ((m_size + 1) > m_slots.size() * 3 / 4)
+        rehash(m_slots.size() * 2);
+
+    size_t slot = homeSlot(key);
+    while (m_slots[slot].window != None)
+        slot = (slot + 1) & (m_slots.size() - 1);
+
+    m_slots[slot] = {key | referencedBit, {}};
+    m_lastAccessed = key;
+    ++m_size;
+    return {Handle(window, slot), true};
+}
+
+Keyboard &WindowTable::operator[](const Handle &handle)
+{
+    const auto key = static_cast<uint32_t>(handle.m_window);
+    m_lastAccessed = key;
+
+    // Slot could be changed after erasing or rehashing
+    if (handle.m_slot >= m_slots.size() || (m_slots[handle.m_slot].window & ~referencedBit) != key) {
+        handle.m_slot = find(key);
+        if (handle.m_slot == m_slots.size())
+            throw std::logic_error("Window " + std::to_string(handle.m_window) + " is not tracked");
+    }
+
+    Slot &slot = m_slots[handle.m_slot];
+    slot.window |= referencedBit;
+    return slot.keyboard;
+}
+
+bool WindowTable::erase(Window window)
+{
+    const size_t slot = find(static_cast<uint32_t>(window));
+    if (slot == m_slots.size())
+        return false;
+
+    eraseSlot(slot);
+    return true;
+}
+
+size_t WindowTable::size() const
+{
+    return m_size;
+}
+
+std::vector<Window> WindowTable::windows() const
+{
+    std::vector<Window> windows;
+    windows.reserve(m_size);
+    for (const Slot &slot : m_slots) {
+        if (slot.window != None)
+            windows.push_back(slot.window & ~referencedBit);
+    }
+    return windows;
+}
+
+size_t WindowTable::find(uint32_t window) const
+{
+    if (window == None)
+        return m_slots.size();
+
+    for (size_t slot = homeSlot(window);; slot = (slot + 1) & (m_slots.size() - 1)) {
+        const uint32_t slotWindow = m_slots[slot].window & ~referencedBit;
+        if (slotWindow == window)
+            return slot;
+        if (slotWindow == None)
+            return m_slots.size();
+    }
+}
+
+size_t WindowTable::homeSlot(uint32_t window) const
+{
+    // Fibonacci hashing: high bits of the product depend on all bits of the window,
+    // including the client base of the resource ID, low bits depend only on low bits of the window
+    return static_cast<uint32_t>(window * 2654435769U) >> m_hashShift;
+}
+
+void WindowTable::eraseSlot(size_t slot)
+{
+    // Shift following entries back instead of leaving tombstones
+    const size_t mask = m_slots.size() - 1;
+    for (size_t next = (slot + 1) & mask; m_slots[next].window != None; next = (next + 1) & mask) {
+        const size_t home = homeSlot(m_slots[next].window & ~referencedBit);
+        const bool canMove = slot <= next ? (home <= slot || home > next) : (home <= slot && home > next);
+        if (canMove) {
+            m_slots[slot] = m_slots[next];
+            slot = next;
+        }
+    }
+
+    m_slots[slot] = {};
+    --m_size;
+}
+
+void WindowTable::evict()
+{
+    // Clock algorithm: skip and clear recently referenced windows
+    const size_t mask = m_slots.size() - 1;
+    while (true) {
+        Slot &slot = m_slots[m_clockHand];
+        if (slot.window & referencedBit) {
+            slot.window &= ~referencedBit;
+        } else if (slot.window != None && slot.window != m_lastAccessed) {
+            eraseSlot(m_clockHand);
+            return;
+        }
+        m_clockHand = (m_clockHand + 1) & mask;
+    }
+}
+
+void WindowTable::rehash(size_t capacity)
+{
+    std::vector<Slot> oldSlots(capacity);
+    m_slots.swap(oldSlots);
+    m_hashShift = hashShift(capacity);
+
+    const size_t mask = m_slots.size() - 1;
+    for (const Slot &oldSlot : oldSlots) {
+        if (oldSlot.window == None)
+            continue;
+
+        size_t slot = homeSlot(oldSlot.window & ~referencedBit);
+        while (m_slots[slot].window != None)
+            slot = (slot + 1) & mask;
+        m_slots[slot] = oldSlot;
+    }
+}
@@ -0,0 +1,96 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WINDOWTABLE_H
+#define WINDOWTABLE_H
+
+#include "keyboard.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <X11/X.h>
+
+// Open addressing hash table with linear probing that stores keyboard state per window
+class WindowTable
+{
+public:
+    // Unlike iterators, handles stay valid when the table is modified
+    class Handle
+    {
+    public:
+        Handle() = default;
+
+        [[nodiscard]] Window window() const;
+
+    private:
+        friend class WindowTable;
+
+        Handle(Window window, size_t slot);
+
+        Window m_window = None;
+        mutable size_t m_slot = 0; // Updated on access if the window was moved
+    };
+
+    // Least recently used windows will be evicted after reaching maxSize, 0 means unlimited
+    explicit WindowTable(size_t maxSize = 0);
+
+    [[nodiscard]] std::pair<Handle, bool> tryEmplace(Window window);
+    [[nodiscard]] Keyboard &operator[](const Handle &handle);
+    bool erase(Window window);
+
+    [[nodiscard]] size_t size() const;
+    [[nodiscard]] std::vector<Window> windows() const;
+
+    template<typename Function>
+    void forEach(Function function)
+    {
+        for (Slot &slot : m_slots) {
+            if (slot.window != None)
+                function(static_cast<Window>(slot.window & ~referencedBit), slot.keyboard);
+        }
+    }
+
+private:
+    struct Slot {
+        uint32_t window = None;
+        Keyboard keyboard;
+    };
+    static_assert(sizeof(Slot) == 8);
+
+    [[nodiscard]] size_t find(uint32_t window) const;
+    [[nodiscard]] size_t homeSlot(uint32_t window) const;
+    void eraseSlot(size_t slot);
+    void evict();
+    void rehash(size_t capacity);
+
+    // X11 resource IDs never have the top three bits set, so one of them is used as a reference bit for eviction
+    static constexpr uint32_t referencedBit = 1U << 31;
+
+    std::vector<Slot> m_slots;
+    size_t m_size = 0;
+    size_t m_maxSize;
+    size_t m_clockHand = 0;
+    unsigned m_hashShift = 0;
+    uint32_t m_lastAccessed = None;
+};
+
+#endif // WINDOWTABLE_H
@@ -45,3 +45,8 @@ void freeVarDefs(XkbRF_VarDefsRec *varDefs)
     if (varDefs->layout)
         XFree(varDefs->layout);
 }
+
+void freeDesc(XkbDescRec *desc)
+{
+    XkbFreeKeyboard(desc, XkbAllComponentsMask, true);
+}
@@ -20,6 +20,7 @@
 #ifndef X11DELETERS_H
 #define X11DELETERS_H
 
+#include <cstdlib>
 #include <type_traits>
 
 #include <X11/Xlib.h>
@@ -28,6 +29,9 @@ using XkbRF_VarDefsRec = class _XkbRF_VarDefs;
 void freeVarDefsWithoutLayout(XkbRF_VarDefsRec *varDefs);
 void freeVarDefs(XkbRF_VarDefsRec *varDefs);
 
+using XkbDescRec = class _XkbDesc;
+void freeDesc(XkbDescRec *desc);
+
 template<auto Func>
 using Deleter = std::integral_constant<std::decay_t<decltype(Func)>, Func>;
 
@@ -35,5 +39,7 @@ using DisplayDeleter = Deleter<XCloseDisplay>;
 using XlibDeleter = Deleter<XFree>;
 using VarDefsWithoutLayoutDeleter = Deleter<freeVarDefsWithoutLayout>;
 using VarDefsDeleter = Deleter<freeVarDefs>;
+using DescDeleter = Deleter<freeDesc>;
+using XcbReplyDeleter = Deleter<free>;
 
 #endif // X11DELETERS_H
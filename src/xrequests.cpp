@@ -0,0 +1,167 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "xrequests.h"
+
+#include "x11deleters.h"
+
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include <X11/XKBlib.h>
+#ifdef WITH_XCB
+#include <X11/Xlib-xcb.h>
+#endif
+
+static uint64_t s_repliesCount = 0;
+
+uint64_t repliesCount()
+{
+    return s_repliesCount;
+}
+
+void countReply()
+{
+    ++s_repliesCount;
+}
+
+AtomRequest::AtomRequest(Display &display, const char *name)
+    : m_display(display)
+#ifdef WITH_XCB
+    , m_cookie(xcb_intern_atom(XGetXCBConnection(&display), false, static_cast<uint16_t>(strlen(name)), name))
+#else
+    , m_name(name)
+#endif
+{
+}
+
+Atom AtomRequest::reply()
+{
+    ++s_repliesCount;
+#ifdef WITH_XCB
+    const std::unique_ptr<xcb_intern_atom_reply_t, XcbReplyDeleter> reply(xcb_intern_atom_reply(XGetXCBConnection(&m_display), m_cookie, nullptr));
+    if (!reply)
+        throw std::logic_error("Unable to intern atom");
+    return reply->atom;
+#else
+    return XInternAtom(&m_display, m_name, false);
+#endif
+}
+
+PropertyRequest::PropertyRequest(Display &display, Window window, Atom property, long length)
+    : m_display(display)
+#ifdef WITH_XCB
+    , m_cookie(xcb_get_property(XGetXCBConnection(&display), false, static_cast<xcb_window_t>(window), static_cast<xcb_atom_t>(property), XCB_GET_PROPERTY_TYPE_ANY, 0, static_cast<uint32_t>(length)))
+#else
+    , m_window(window)
+    , m_property(property)
+    , m_length(length)
+#endif
+{
+}
+
+#ifdef WITH_XCB
+std::vector<Window> PropertyRequest::windowsReply()
+{
+    ++s_repliesCount;
+    const std::unique_ptr<xcb_get_property_reply_t, XcbReplyDeleter> reply(xcb_get_property_reply(XGetXCBConnection(&m_display), m_cookie, nullptr));
+    // Window could be already destroyed
+    if (!reply || reply->format != 32)
+        return {};
+
+    const auto *windows = static_cast<const xcb_window_t *>(xcb_get_property_value(reply.get()));
+    return {windows, windows + xcb_get_property_value_length(reply.get()) / sizeof(xcb_window_t)};
+}
+
+std::string PropertyRequest::stringReply()
+{
+    ++s_repliesCount;
+    const std::unique_ptr<xcb_get_property_reply_t, XcbReplyDeleter> reply(xcb_get_property_reply(XGetXCBConnection(&m_display), m_cookie, nullptr));
+    if (!reply || reply->format != 8)
+        return {};
+
+    return {static_cast<const char *>(xcb_get_property_value(reply.get())), static_cast<size_t>(xcb_get_property_value_length(reply.get()))};
+}
+#else
+std::vector<Window> PropertyRequest::windowsReply()
+{
+    ++s_repliesCount;
+    Atom type;
+    int format;
+    unsigned long size;
+    unsigned long remainSize;
+    unsigned char *bytes;
+
+    // Window could be already destroyed
+    if (XGetWindowProperty(&m_display, m_window, m_property, 0, m_length, false, AnyPropertyType, &type, &format, &size, &remainSize, &bytes) != Success)
+        return {};
+
+    const std::unique_ptr<unsigned char[], XlibDeleter> data(bytes);
+    if (type == None || format != 32)
+        return {};
+
+    // Xlib returns 32-bit items as long
+    const auto *windows = reinterpret_cast<const Window *>(data.get());
+    return {windows, windows + size};
+}
+
+std::string PropertyRequest::stringReply()
+{
+    ++s_repliesCount;
+    Atom type;
+    int format;
+    unsigned long size;
+    unsigned long remainSize;
+    unsigned char *bytes;
+
+    if (XGetWindowProperty(&m_display, m_window, m_property, 0, m_length, false, AnyPropertyType, &type, &format, &size, &remainSize, &bytes) != Success)
+        return {};
+
+    const std::unique_ptr<unsigned char[], XlibDeleter> data(bytes);
+    if (type == None || format != 8)
+        return {};
+
+    return {reinterpret_cast<const char *>(data.get()), size};
+}
+#endif
+
+GroupRequest::GroupRequest(Display &display)
+    : m_display(display)
+#ifdef WITH_XCB
+    , m_cookie(xcb_xkb_get_state(XGetXCBConnection(&display), XCB_XKB_ID_USE_CORE_KBD))
+#endif
+{
+}
+
+unsigned char GroupRequest::reply()
+{
+    ++s_repliesCount;
+#ifdef WITH_XCB
+    const std::unique_ptr<xcb_xkb_get_state_reply_t, XcbReplyDeleter> reply(xcb_xkb_get_state_reply(XGetXCBConnection(&m_display), m_cookie, nullptr));
+    if (!reply)
+        throw std::logic_error("Unable to get keyboard state");
+    return reply->group;
+#else
+    XkbStateRec state;
+    if (XkbGetState(&m_display, XkbUseCoreKbd, &state) != Success)
+        throw std::logic_error("Unable to get keyboard state");
+    return state.group;
+#endif
+}
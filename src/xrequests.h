@@ -0,0 +1,93 @@
+/*
+ *  Copyright © 2019-2021 Hennadii Chernyshchyk <genaloner@gmail.com>
+ *
+ *  This file is part of Advanced Keyboard Daemon.
+ *
+ *  Advanced Keyboard Daemon is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Advanced Keyboard Daemon is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Advanced Keyboard Daemon. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef XREQUESTS_H
+#define XREQUESTS_H
+
+#include "cmake.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <X11/Xlib.h>
+#ifdef WITH_XCB
+#include <xcb/xcb.h>
+#include <xcb/xkb.h>
+#endif
+
+// Requests are sent on construction and replies are waited only in reply functions,
+// so independent requests cost a single round-trip. Without XCB requests are performed in reply functions.
+
+// Number of waited replies, pipelined replies are counted separately
+[[nodiscard]] uint64_t repliesCount();
+// Counts a reply waited inside a blocking Xlib call, like keymap compilation or rules reading
+void countReply();
+
+class AtomRequest
+{
+public:
+    AtomRequest(Display &display, const char *name);
+
+    [[nodiscard]] Atom reply();
+
+private:
+    Display &m_display;
+#ifdef WITH_XCB
+    xcb_intern_atom_cookie_t m_cookie;
+#else
+    const char *m_name;
+#endif
+};
+
+class PropertyRequest
+{
+public:
+    PropertyRequest(Display &display, Window window, Atom property, long length = 1);
+
+    // Only one of the functions can be called, they return empty values if the property is not set or the window doesn't exist
+    [[nodiscard]] std::vector<Window> windowsReply();
+    [[nodiscard]] std::string stringReply();
+
+private:
+    Display &m_display;
+#ifdef WITH_XCB
+    xcb_get_property_cookie_t m_cookie;
+#else
+    Window m_window;
+    Atom m_property;
+    long m_length;
+#endif
+};
+
+class GroupRequest
+{
+public:
+    explicit GroupRequest(Display &display);
+
+    [[nodiscard]] unsigned char reply();
+
+private:
+    Display &m_display;
+#ifdef WITH_XCB
+    xcb_xkb_get_state_cookie_t m_cookie;
+#endif
+};
+
+#endif // XREQUESTS_H